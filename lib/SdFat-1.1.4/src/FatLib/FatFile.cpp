@@ -33,6 +33,10 @@ void (*FatFile::m_dateTime)(uint16_t* date, uint16_t* time) = 0;
 // Add a cluster to a file.
 bool FatFile::addCluster() {
   m_flags |= F_FILE_DIR_DIRTY;
+  if (m_extents) {
+    // the chain grows past the end the map found
+    m_extents->m_closed = false;
+  }
   return m_vol->allocateCluster(m_curCluster, &m_curCluster);
 }
 //------------------------------------------------------------------------------
@@ -95,6 +99,7 @@ fail:
 bool FatFile::close() {
   bool rtn = sync();
   m_attr = FILE_ATTR_CLOSED;
+  m_extents = 0;
   return rtn;
 }
 //------------------------------------------------------------------------------
@@ -178,6 +183,98 @@ bool FatFile::dirEntry(dir_t* dst) {
   memcpy(dst, dir, sizeof(dir_t));
   return true;
 
+fail:
+  return false;
+}
+//------------------------------------------------------------------------------
+// Find the cluster with a given index in the file, and the number of
+// consecutive clusters that follow it, from the extent map.
+bool FatFile::extentFind(uint32_t index, uint32_t* cluster, uint32_t* follow) {
+  FatExtentMap* map = m_extents;
+  FatExtent* run;
+  uint8_t lo = 0;
+  uint8_t hi;
+  // index in the last run may extend it, beyond it needs more runs
+  if (!map->m_closed && (map->m_count == 0 ||
+      index >= map->m_run[map->m_count - 1].index)) {
+    if (!extentMapTo(index)) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+  }
+  // last run starting at or before index
+  hi = map->m_count;
+  if (hi == 0) {
+    goto fail;
+  }
+  while (hi - lo > 1) {
+    uint8_t mid = (lo + hi)/2;
+    if (map->m_run[mid].index <= index) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  run = &map->m_run[lo];
+  if ((index - run->index) >= run->count) {
+    // past a full map
+    goto fail;
+  }
+  *cluster = run->cluster + index - run->index;
+  *follow = run->count - (index - run->index) - 1;
+  return true;
+
+fail:
+  return false;
+}
+//------------------------------------------------------------------------------
+// Follow the cluster chain from the end of the extent map until the run
+// holding index is complete, the chain ends or the map is full.
+bool FatFile::extentMapTo(uint32_t index) {
+  FatExtentMap* map = m_extents;
+  FatExtent* run;
+  uint32_t last;
+  uint32_t next;
+  int8_t fg;
+  if (map->m_count == 0) {
+    if (m_firstCluster == 0) {
+      goto fail;
+    }
+    run = map->m_run;
+    run->index = 0;
+    run->cluster = m_firstCluster;
+    run->count = 1;
+    map->m_count = 1;
+  }
+  run = &map->m_run[map->m_count - 1];
+  while (!map->m_closed) {
+    last = run->cluster + run->count - 1;
+    fg = m_vol->fatGet(last, &next);
+    if (fg < 0) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+    if (fg == 0) {
+      // end of chain
+      map->m_closed = true;
+    } else if (next == last + 1) {
+      run->count++;
+    } else if (map->m_count == FAT_EXTENT_MAP_RUNS) {
+      map->m_closed = true;
+    } else {
+      run[1].index = run->index + run->count;
+      run[1].cluster = next;
+      run[1].count = 1;
+      run++;
+      map->m_count++;
+      if (run->index > index) {
+        // run holding index is complete
+        break;
+      }
+    }
+  }
+  return true;
+
 fail:
   return false;
 }
@@ -733,6 +830,7 @@ int FatFile::peek() {
 //------------------------------------------------------------------------------
 int FatFile::read(void* buf, size_t nbyte) {
   int8_t fg;
+  uint32_t follow;
   uint8_t blockOfCluster = 0;
   uint8_t* dst = reinterpret_cast<uint8_t*>(buf);
   uint16_t offset;
@@ -770,6 +868,10 @@ int FatFile::read(void* buf, size_t nbyte) {
         if (m_curPosition == 0) {
           // use first cluster in file
           m_curCluster = isRoot32() ? m_vol->rootDirStart() : m_firstCluster;
+        } else if (m_extents && isFile() &&
+                   extentFind(m_curPosition >> (m_vol->clusterSizeShift() + 9),
+                              &m_curCluster, &follow)) {
+          // next cluster from the extent map
         } else {
           // get next cluster from FAT
           fg = m_vol->fatGet(m_curCluster, &m_curCluster);
@@ -788,7 +890,7 @@ int FatFile::read(void* buf, size_t nbyte) {
       }
       block = m_vol->clusterFirstBlock(m_curCluster) + blockOfCluster;
     }
-    if (offset != 0 || toRead < 512 || block == m_vol->cacheBlockNumber()) {
+    if (offset != 0 || toRead < 512 || m_vol->cacheHolds(block)) {
       // amount to be read from current block
       n = 512 - offset;
       if (n > toRead) {
@@ -806,14 +908,20 @@ int FatFile::read(void* buf, size_t nbyte) {
     } else if (toRead >= 1024) {
       size_t nb = toRead >> 9;
       if (!isRootFixed()) {
-        uint8_t mb = m_vol->blocksPerCluster() - blockOfCluster;
+        size_t mb = m_vol->blocksPerCluster() - blockOfCluster;
+        uint32_t cluster;
+        if (mb < nb && m_extents && isFile() &&
+            extentFind(m_curPosition >> (m_vol->clusterSizeShift() + 9),
+                       &cluster, &follow)) {
+          // read on into the consecutive clusters of the run
+          mb += (size_t)follow << m_vol->clusterSizeShift();
+        }
         if (mb < nb) {
           nb = mb;
         }
       }
       n = 512*nb;
-      if (m_vol->cacheBlockNumber() <= block
-          && block < (m_vol->cacheBlockNumber() + nb)) {
+      if (m_vol->cacheHolds(block, nb)) {
         // flush cache if a block is in the cache
         if (!m_vol->cacheSyncData()) {
           DBG_FAIL_MACRO;
@@ -824,6 +932,10 @@ int FatFile::read(void* buf, size_t nbyte) {
         DBG_FAIL_MACRO;
         goto fail;
       }
+      if (!isRootFixed()) {
+        // cluster of the last block read
+        m_curCluster += (blockOfCluster + nb - 1) >> m_vol->clusterSizeShift();
+      }
 #endif  // USE_MULTI_BLOCK_IO
     } else {
       // read single block
@@ -1011,6 +1123,61 @@ bool FatFile::rename(FatFile* dirFile, const char* newPath) {
   }
   return m_vol->cacheSync();
 
+fail:
+  return false;
+}
+//------------------------------------------------------------------------------
+bool FatFile::replace(FatFile* target) {
+  dir_t* dir;
+  dir_t srcDir;
+  uint32_t oldCluster;
+
+  // Both must be files open for write on the same volume.
+  if (!isFile() || !(m_flags & F_WRITE) || !target || !target->isFile() ||
+      !(target->m_flags & F_WRITE) || m_vol != target->m_vol) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  if (!sync() || !target->sync() || !dirEntry(&srcDir)) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  oldCluster = target->m_firstCluster;
+
+  // Point the target entry at the new data.
+  dir = target->cacheDirEntry(FatCache::CACHE_FOR_WRITE);
+  if (!dir) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  dir->firstClusterLow = m_firstCluster & 0XFFFF;
+  dir->firstClusterHigh = m_firstCluster >> 16;
+  dir->fileSize = m_fileSize;
+  dir->lastWriteDate = srcDir.lastWriteDate;
+  dir->lastWriteTime = srcDir.lastWriteTime;
+  dir->lastAccessDate = srcDir.lastAccessDate;
+  target->m_firstCluster = m_firstCluster;
+  target->m_fileSize = m_fileSize;
+  target->m_curCluster = 0;
+  target->m_curPosition = 0;
+  if (target->m_extents) {
+    target->m_extents->clear();
+  }
+
+  // Remove this entry, the clusters now belong to target.  The sync in
+  // remove() writes both entries, no chain is ever shared by two entries.
+  m_firstCluster = 0;
+  if (!remove()) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  // Free the old data of target.
+  if (oldCluster && !m_vol->freeChain(oldCluster)) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  return m_vol->cacheSync();
+
 fail:
   return false;
 }
@@ -1135,6 +1302,8 @@ fail:
 bool FatFile::seekSet(uint32_t pos) {
   uint32_t nCur;
   uint32_t nNew;
+  uint32_t mapped;
+  uint32_t follow;
   uint32_t tmp = m_curCluster;
   // error if file not open
   if (!isOpen()) {
@@ -1166,7 +1335,17 @@ bool FatFile::seekSet(uint32_t pos) {
   nCur = (m_curPosition - 1) >> (m_vol->clusterSizeShift() + 9);
   nNew = (pos - 1) >> (m_vol->clusterSizeShift() + 9);
 
-  if (nNew < nCur || m_curPosition == 0) {
+  if (m_extents && isFile() && extentFind(nNew, &m_curCluster, &follow)) {
+    // found in the extent map
+    goto done;
+  }
+  mapped = m_extents && isFile() ? m_extents->mapped() : 0;
+  if (mapped && nNew >= mapped &&
+      (nNew < nCur || m_curPosition == 0 || nCur < mapped - 1)) {
+    // follow the chain on from the last cluster of a full map
+    m_curCluster = m_extents->lastCluster();
+    nNew -= mapped - 1;
+  } else if (nNew < nCur || m_curPosition == 0) {
     // must follow chain from first cluster
     m_curCluster = isRoot32() ? m_vol->rootDirStart() : m_firstCluster;
   } else {
@@ -1194,6 +1373,31 @@ void FatFile::setpos(FatPos_t* pos) {
   m_curCluster = pos->cluster;
 }
 //------------------------------------------------------------------------------
+bool FatFile::setHidden(bool hidden) {
+  dir_t* dir;
+
+  if (!(isFile() || isSubDir())) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  dir = cacheDirEntry(FatCache::CACHE_FOR_WRITE);
+  if (!dir) {
+    DBG_FAIL_MACRO;
+    goto fail;
+  }
+  if (hidden) {
+    dir->attributes |= DIR_ATT_HIDDEN;
+    m_attr |= FILE_ATTR_HIDDEN;
+  } else {
+    dir->attributes &= ~DIR_ATT_HIDDEN;
+    m_attr &= ~FILE_ATTR_HIDDEN;
+  }
+  return m_vol->cacheSync();
+
+fail:
+  return false;
+}
+//------------------------------------------------------------------------------
 bool FatFile::sync() {
   if (!isOpen()) {
     return true;
@@ -1368,6 +1572,9 @@ bool FatFile::truncate(uint32_t length) {
       }
     }
   }
+  if (m_extents) {
+    m_extents->clear();
+  }
   m_fileSize = length;
 
   // need to update directory entry
@@ -1482,11 +1689,8 @@ int FatFile::write(const void* buf, size_t nbyte) {
         nb = maxBlocks;
       }
       n = 512*nb;
-      if (m_vol->cacheBlockNumber() <= block
-          && block < (m_vol->cacheBlockNumber() + nb)) {
-        // invalidate cache if block is in cache
-        m_vol->cacheInvalidate();
-      }
+      // invalidate cached blocks in the range
+      m_vol->cacheInvalidate(block, nb);
       if (!m_vol->writeBlocks(block, src, nb)) {
         DBG_FAIL_MACRO;
         goto fail;
@@ -1495,9 +1699,7 @@ int FatFile::write(const void* buf, size_t nbyte) {
     } else {
       // use single block write command
       n = 512;
-      if (m_vol->cacheBlockNumber() == block) {
-        m_vol->cacheInvalidate();
-      }
+      m_vol->cacheInvalidate(block, 1);
       if (!m_vol->writeBlock(block, src)) {
         DBG_FAIL_MACRO;
         goto fail;
@@ -72,6 +72,49 @@ struct FatPos_t {
   FatPos_t() : position(0), cluster(0) {}
 };
 //------------------------------------------------------------------------------
+/**
+ * \struct FatExtent
+ * \brief Run of consecutive clusters in a file's cluster chain.
+ */
+struct FatExtent {
+  /** index in the file of the first cluster of the run */
+  uint32_t index;
+  /** first cluster of the run */
+  uint32_t cluster;
+  /** number of clusters in the run */
+  uint32_t count;
+};
+//------------------------------------------------------------------------------
+/**
+ * \class FatExtentMap
+ * \brief Runs of the cluster chain of an open file, filled as the chain
+ * is followed.  Attach one with FatFile::setExtentMap().
+ */
+class FatExtentMap {
+ public:
+  FatExtentMap() {
+    clear();
+  }
+  /** Forget all runs. */
+  void clear() {
+    m_count = 0;
+    m_closed = false;
+  }
+  /** \return The number of file clusters covered by the runs. */
+  uint32_t mapped() const {
+    return m_count ? m_run[m_count - 1].index + m_run[m_count - 1].count : 0;
+  }
+
+ private:
+  friend class FatFile;
+  uint32_t lastCluster() const {
+    return m_run[m_count - 1].cluster + m_run[m_count - 1].count - 1;
+  }
+  FatExtent m_run[FAT_EXTENT_MAP_RUNS];
+  uint8_t m_count;   // runs in use
+  bool m_closed;     // end of chain or of the map reached, nothing to add
+};
+//------------------------------------------------------------------------------
 /** Expression for path name separator. */
 #define isDirSeparator(c) ((c) == '/')
 //------------------------------------------------------------------------------
@@ -110,7 +153,7 @@ const uint8_t FNAME_FLAG_LC_EXT = DIR_NT_LC_EXT;
 class FatFile {
  public:
   /** Create an instance. */
-  FatFile() : m_attr(FILE_ATTR_CLOSED), m_error(0) {}
+  FatFile() : m_attr(FILE_ATTR_CLOSED), m_error(0), m_extents(0) {}
   /**  Create a file object and open it in the current working directory.
    *
    * \param[in] path A path with a valid 8.3 DOS name for a file to be opened.
@@ -121,6 +164,7 @@ class FatFile {
   FatFile(const char* path, oflag_t oflag) {
     m_attr = FILE_ATTR_CLOSED;
     m_error = 0;
+    m_extents = 0;
     open(path, oflag);
   }
 #if DESTRUCTOR_CLOSES_FILE
@@ -750,6 +794,26 @@ class FatFile {
    * the value false is returned for failure.
    */
   static bool remove(FatFile* dirFile, const char* path);
+  /** Set or clear the hidden attribute of the directory entry.
+   *
+   * \param[in] hidden True to hide the file.
+   *
+   * \return The value true is returned for success and
+   * the value false is returned for failure.
+   */
+  bool setHidden(bool hidden);
+  /** Attach a map of the file's cluster runs, used by seekSet() and
+   * read() until the file is closed.  The map is cleared and filled
+   * as the cluster chain is followed.
+   *
+   * \param[in] map Storage for the runs, zero to detach.
+   */
+  void setExtentMap(FatExtentMap* map) {
+    m_extents = map;
+    if (map) {
+      map->clear();
+    }
+  }
   /** Set the file's current position to zero. */
   void rewind() {
     seekSet(0);
@@ -775,6 +839,20 @@ class FatFile {
    * the value false is returned for failure.
    */
   bool rename(FatFile* dirFile, const char* newPath);
+  /** Replace the data of another file with the data of this file.
+   *
+   * The directory entry of \a target is pointed at the clusters of this
+   * file and the directory entry of this file is removed in the same
+   * sync, only then are the old clusters of \a target freed.  A crash
+   * may leak the old clusters but never leaves two entries on one chain.
+   * Both files must be open for write.
+   *
+   * \param[in] target File that takes over the data.
+   *
+   * \return The value true is returned for success and
+   * the value false is returned for failure.
+   */
+  bool replace(FatFile* target);
   /** Remove a directory file.
    *
    * The directory file will be removed only if it is empty and is not the
@@ -997,6 +1075,8 @@ class FatFile {
   bool open(FatFile* dirFile, fname_t* fname, oflag_t oflag);
   bool openCachedEntry(FatFile* dirFile, uint16_t cacheIndex, oflag_t oflag,
                        uint8_t lfnOrd);
+  bool extentFind(uint32_t index, uint32_t* cluster, uint32_t* follow);
+  bool extentMapTo(uint32_t index);
   bool readLBN(uint32_t* lbn);
   dir_t* readDirCache(bool skipReadOk = false);
   bool setDirSize();
@@ -1028,5 +1108,6 @@ class FatFile {
   uint32_t   m_dirBlock;         // block for this files directory entry
   uint32_t   m_fileSize;         // file size in bytes
   uint32_t   m_firstCluster;     // first cluster of file
+  FatExtentMap* m_extents;       // cluster runs of the file, zero if none
 };
 #endif  // FatFile_h
@@ -26,22 +26,39 @@
 #include "FatVolume.h"
 //------------------------------------------------------------------------------
 cache_t* FatCache::read(uint32_t lbn, uint8_t option) {
-  if (m_lbn != lbn) {
-    if (!sync()) {
+  uint8_t i;
+  uint8_t victim = 0;
+  // Find the block, else the least recently used slot, unused slots first
+  // and held FAT blocks last.
+  for (i = 0; i < FAT_CACHE_BLOCKS; i++) {
+    if (m_lbn[i] == lbn) {
+      break;
+    }
+    if (held(i) == held(victim) ? m_used[i] < m_used[victim] : held(victim)) {
+      victim = i;
+    }
+  }
+  if (i == FAT_CACHE_BLOCKS) {
+    i = victim;
+    if (!syncBlock(i)) {
       DBG_FAIL_MACRO;
       goto fail;
     }
+    m_status[i] = 0;
+    m_lbn[i] = 0XFFFFFFFF;
     if (!(option & CACHE_OPTION_NO_READ)) {
-      if (!m_vol->readBlock(lbn, m_block.data)) {
+      if (!m_vol->readBlock(lbn, m_block[i].data)) {
+        m_used[i] = 0;
         DBG_FAIL_MACRO;
         goto fail;
       }
     }
-    m_status = 0;
-    m_lbn = lbn;
+    m_lbn[i] = lbn;
   }
-  m_status |= option & CACHE_STATUS_MASK;
-  return &m_block;
+  m_status[i] |= option & CACHE_STATUS_MASK;
+  m_used[i] = ++m_clock;
+  m_current = i;
+  return &m_block[i];
 
 fail:
 
@@ -49,20 +66,40 @@ fail:
 }
 //------------------------------------------------------------------------------
 bool FatCache::sync() {
-  if (m_status & CACHE_STATUS_DIRTY) {
-    if (!m_vol->writeBlock(m_lbn, m_block.data)) {
+  for (uint8_t i = 0; i < FAT_CACHE_BLOCKS; i++) {
+    if (!syncBlock(i)) {
+      DBG_FAIL_MACRO;
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+bool FatCache::syncData() {
+  for (uint8_t i = 0; i < FAT_CACHE_BLOCKS; i++) {
+    if (!held(i) && !syncBlock(i)) {
+      DBG_FAIL_MACRO;
+      return false;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+bool FatCache::syncBlock(uint8_t i) {
+  if (m_status[i] & CACHE_STATUS_DIRTY) {
+    if (!m_vol->writeBlock(m_lbn[i], m_block[i].data)) {
       DBG_FAIL_MACRO;
       goto fail;
     }
     // mirror second FAT
-    if (m_status & CACHE_STATUS_MIRROR_FAT) {
-      uint32_t lbn = m_lbn + m_vol->blocksPerFat();
-      if (!m_vol->writeBlock(lbn, m_block.data)) {
+    if (m_status[i] & CACHE_STATUS_MIRROR_FAT) {
+      uint32_t lbn = m_lbn[i] + m_vol->blocksPerFat();
+      if (!m_vol->writeBlock(lbn, m_block[i].data)) {
         DBG_FAIL_MACRO;
         goto fail;
       }
     }
-    m_status &= ~CACHE_STATUS_DIRTY;
+    m_status[i] &= ~CACHE_STATUS_DIRTY;
   }
   return true;
 
@@ -98,6 +135,17 @@ bool FatVolume::allocateCluster(uint32_t current, uint32_t* next) {
       DBG_FAIL_MACRO;
       goto fail;
     }
+    int8_t state = freeIndexState(find);
+    if (state < 0) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+    if (state == FREE_INDEX_FULL) {
+      // Skip the group, but not past current.
+      uint32_t last = freeIndexLast(find);
+      find = (find < current && current <= last) ? current - 1 : last;
+      continue;
+    }
     uint32_t f;
     int8_t fg = fatGet(find, &f);
     if (fg < 0) {
@@ -123,7 +171,7 @@ bool FatVolume::allocateCluster(uint32_t current, uint32_t* next) {
       goto fail;
     }
   }
-  updateFreeClusterCount(-1);
+  updateFreeClusterCount(-1, find);
   *next = find;
   return true;
 
@@ -145,8 +193,9 @@ bool FatVolume::allocContiguous(uint32_t count,
     setStart = false;
   } else {
     // Start at cluster after last allocated cluster.
-    bgnCluster = m_allocSearchStart + 1;
-    setStart = true;
+    bgnCluster = alignCluster(m_allocSearchStart + 1);
+    // free clusters skipped for alignment must still be found later
+    setStart = bgnCluster == m_allocSearchStart + 1;
   }
   endCluster = bgnCluster;
   // search the FAT for free clusters
@@ -156,8 +205,33 @@ bool FatVolume::allocContiguous(uint32_t count,
       DBG_FAIL_MACRO;
       goto fail;
     }
-    uint32_t f;
-    int8_t fg = fatGet(endCluster, &f);
+    int8_t state = freeIndexState(endCluster);
+    if (state < 0) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+    if (state == FREE_INDEX_EMPTY) {
+      // The rest of the group is free, take it without reading the FAT.
+      uint32_t last = freeIndexLast(endCluster);
+      if (last - bgnCluster + 1 >= count) {
+        endCluster = bgnCluster + count - 1;
+        break;
+      }
+      endCluster = last + 1;
+      continue;
+    }
+    uint32_t f = 0;
+    int8_t fg = 1;
+    if (state == FREE_INDEX_FULL) {
+      // Treat the group as one cluster in use.
+      if (bgnCluster == endCluster) {
+        bgnCluster = freeIndexLast(endCluster);
+      }
+      endCluster = freeIndexLast(endCluster);
+      f = 1;
+    } else {
+      fg = fatGet(endCluster, &f);
+    }
     if (fg < 0) {
       DBG_FAIL_MACRO;
       goto fail;
@@ -172,7 +246,11 @@ bool FatVolume::allocContiguous(uint32_t count,
         setStart = false;
       }
       // cluster in use try next cluster as bgnCluster
-      bgnCluster = endCluster + 1;
+      bgnCluster = alignCluster(endCluster + 1);
+      if (bgnCluster != endCluster + 1) {
+        setStart = false;
+      }
+      endCluster = bgnCluster - 1;
     } else if ((endCluster - bgnCluster + 1) == count) {
       // done - found space
       break;
@@ -197,7 +275,7 @@ bool FatVolume::allocContiguous(uint32_t count,
     endCluster--;
   }
   // Maintain count of free clusters.
-  updateFreeClusterCount(-count);
+  updateFreeClusterCount(-count, bgnCluster);
 
   // return first cluster number to caller
   *firstCluster = bgnCluster;
@@ -207,6 +285,115 @@ fail:
   return false;
 }
 //------------------------------------------------------------------------------
+void FatVolume::freeIndexInit() {
+  m_freeIndexShift = FREE_INDEX_OFF;
+#if FAT_FREE_INDEX_BYTES
+  if (fatType() != 16 && fatType() != 32) {
+    return;
+  }
+  // Smallest group of FAT blocks that lets the index cover the whole FAT.
+  uint8_t shift = fatType() == 32 ? 7 : 8;
+  while ((m_lastCluster >> shift) >= 4UL*FAT_FREE_INDEX_BYTES) {
+    shift++;
+  }
+  m_freeIndexShift = shift;
+  freeIndexReset();
+#endif  // FAT_FREE_INDEX_BYTES
+}
+//------------------------------------------------------------------------------
+void FatVolume::freeIndexReset() {
+#if FAT_FREE_INDEX_BYTES
+  memset(m_freeIndex, 0, sizeof(m_freeIndex));
+#endif  // FAT_FREE_INDEX_BYTES
+}
+//------------------------------------------------------------------------------
+// state of the group holding cluster, classified from the FAT when unknown
+int8_t FatVolume::freeIndexState(uint32_t cluster) {
+#if FAT_FREE_INDEX_BYTES
+  if (m_freeIndexShift == FREE_INDEX_OFF) {
+    return FREE_INDEX_MIXED;
+  }
+  uint32_t group = cluster >> m_freeIndexShift;
+  uint8_t pos = (group & 3) << 1;
+  uint8_t state = (m_freeIndex[group >> 2] >> pos) & 3;
+  if (state != FREE_INDEX_UNKNOWN) {
+    return state;
+  }
+  bool used = false;
+  bool free = false;
+  uint32_t last = freeIndexLast(cluster);
+  for (uint32_t c = group << m_freeIndexShift; c <= last && !(used && free);) {
+    uint32_t lba = m_fatStartBlock + (fatType() == 32 ? c >> 7 : c >> 8);
+    cache_t* pc = cacheFetchFat(lba, FatCache::CACHE_FOR_READ);
+    if (!pc) {
+      DBG_FAIL_MACRO;
+      return -1;
+    }
+    do {
+      uint32_t next = fatType() == 32 ? pc->fat32[c & 0X7F] & FAT32MASK
+                                      : pc->fat16[c & 0XFF];
+      if (next) {
+        used = true;
+      } else {
+        free = true;
+      }
+      c++;
+    } while (c <= last && (c & (fatType() == 32 ? 0X7F : 0XFF)));
+  }
+  state = !free ? FREE_INDEX_FULL : !used ? FREE_INDEX_EMPTY : FREE_INDEX_MIXED;
+  m_freeIndex[group >> 2] |= state << pos;
+  return state;
+#else  // FAT_FREE_INDEX_BYTES
+  (void)cluster;
+  return FREE_INDEX_MIXED;
+#endif  // FAT_FREE_INDEX_BYTES
+}
+//------------------------------------------------------------------------------
+// a full group gains a free cluster, an empty one loses it
+void FatVolume::freeIndexUpdate(uint32_t cluster, bool free) {
+#if FAT_FREE_INDEX_BYTES
+  if (m_freeIndexShift == FREE_INDEX_OFF) {
+    return;
+  }
+  uint32_t group = cluster >> m_freeIndexShift;
+  uint8_t pos = (group & 3) << 1;
+  uint8_t state = (m_freeIndex[group >> 2] >> pos) & 3;
+  if (state == (free ? FREE_INDEX_FULL : FREE_INDEX_EMPTY)) {
+    m_freeIndex[group >> 2] |= FREE_INDEX_MIXED << pos;
+  }
+#else  // FAT_FREE_INDEX_BYTES
+  (void)cluster;
+  (void)free;
+#endif  // FAT_FREE_INDEX_BYTES
+}
+//------------------------------------------------------------------------------
+// next cluster at or after cluster that starts on the allocation boundary
+uint32_t FatVolume::alignCluster(uint32_t cluster) const {
+  if (!m_allocAlignStep) {
+    return cluster;
+  }
+  if (cluster <= m_allocAlignFirst) {
+    return m_allocAlignFirst;
+  }
+  uint32_t r = (cluster - m_allocAlignFirst) % m_allocAlignStep;
+  return r ? cluster + m_allocAlignStep - r : cluster;
+}
+//------------------------------------------------------------------------------
+bool FatVolume::setContiguousAlignment(uint32_t blocks) {
+  m_allocAlignStep = 0;
+  if (blocks <= m_blocksPerCluster || blocks % m_blocksPerCluster) {
+    return false;
+  }
+  // blocks from the start of the data area to the first aligned block
+  uint32_t lead = (blocks - m_dataStartBlock % blocks) % blocks;
+  if (lead % m_blocksPerCluster) {
+    return false;
+  }
+  m_allocAlignStep = blocks >> m_clusterSizeShift;
+  m_allocAlignFirst = 2 + (lead >> m_clusterSizeShift);
+  return true;
+}
+//------------------------------------------------------------------------------
 uint32_t FatVolume::clusterFirstBlock(uint32_t cluster) const {
   return m_dataStartBlock + ((cluster - 2) << m_clusterSizeShift);
 }
@@ -300,6 +487,7 @@ bool FatVolume::fatPut(uint32_t cluster, uint32_t value) {
       goto fail;
     }
     pc->fat32[cluster & 0X7F] = value;
+    freeIndexUpdate(cluster, value == 0);
     return true;
   }
 
@@ -311,6 +499,7 @@ bool FatVolume::fatPut(uint32_t cluster, uint32_t value) {
       goto fail;
     }
     pc->fat16[cluster & 0XFF] = value;
+    freeIndexUpdate(cluster, value == 0);
     return true;
   }
 
@@ -371,7 +560,7 @@ bool FatVolume::freeChain(uint32_t cluster) {
       goto fail;
     }
     // Add one to count of free clusters.
-    updateFreeClusterCount(1);
+    updateFreeClusterCount(1, cluster);
 
     if (cluster <= m_allocSearchStart) {
       m_allocSearchStart = cluster - 1;
@@ -387,7 +576,7 @@ fail:
 //------------------------------------------------------------------------------
 int32_t FatVolume::freeClusterCount() {
 #if MAINTAIN_FREE_CLUSTER_COUNT
-  if (m_freeClusterCount >= 0) {
+  if (m_freeCountValid) {
     return m_freeClusterCount;
   }
 #endif  // MAINTAIN_FREE_CLUSTER_COUNT
@@ -447,10 +636,114 @@ fail:
   return -1;
 }
 //------------------------------------------------------------------------------
+bool FatVolume::freeClusterScan(uint32_t blocks, uint8_t* buf) {
+#if MAINTAIN_FREE_CLUSTER_COUNT
+  uint32_t lbn;
+  uint32_t todo;
+  uint16_t n;
+  cache_t* pc;
+  if (m_freeCountValid) {
+    return true;
+  }
+  if (fatType() != 16 && fatType() != 32) {
+    return freeClusterCount() >= 0;
+  }
+  n = fatType() == 16 ? 256 : 128;
+  if (m_freeScanBlock == 0) {
+    m_freeScanCount = 0;
+  }
+  while (blocks--) {
+    todo = m_lastCluster + 1 - m_freeScanBlock*n;
+    if (todo > n) {
+      todo = n;
+    }
+    lbn = m_fatStartBlock + m_freeScanBlock;
+    if (fatCacheHolds(lbn)) {
+      // cached copy, possibly newer than the device
+      pc = cacheFetchFat(lbn, FatCache::CACHE_FOR_READ);
+    } else {
+      // read past the cache, the blocks it holds stay
+      pc = reinterpret_cast<cache_t*>(buf);
+      if (!readBlock(lbn, buf)) {
+        pc = 0;
+      }
+    }
+    if (!pc) {
+      DBG_FAIL_MACRO;
+      goto fail;
+    }
+    for (uint16_t i = 0; i < todo; i++) {
+      if (fatType() == 16 ? pc->fat16[i] == 0 : pc->fat32[i] == 0) {
+        m_freeScanCount++;
+      }
+    }
+    m_freeScanBlock++;
+    if (m_freeScanBlock*n > m_lastCluster) {
+      if ((int32_t)m_freeScanCount != m_freeClusterCount) {
+        setFreeClusterCount(m_freeScanCount);
+      }
+      m_freeCountValid = true;
+      m_freeScanBlock = 0;
+      return true;
+    }
+  }
+  return false;
+
+fail:
+  m_freeScanBlock = 0;
+  return false;
+#else  // MAINTAIN_FREE_CLUSTER_COUNT
+  (void)blocks;
+  (void)buf;
+  return false;
+#endif  // MAINTAIN_FREE_CLUSTER_COUNT
+}
+#if MAINTAIN_FREE_CLUSTER_COUNT
+//------------------------------------------------------------------------------
+void FatVolume::freeCountInit(uint32_t fsInfoBlock) {
+  m_fsInfoBlock = fsInfoBlock;
+  setFreeClusterCount(-1);
+  if (!fsInfoBlock) {
+    return;
+  }
+  cache_t* pc = cacheFetchData(m_fsInfoBlock, FatCache::CACHE_FOR_READ);
+  if (!pc || pc->fsinfo.leadSignature != FSINFO_LEAD_SIG ||
+      pc->fsinfo.structSignature != FSINFO_STRUCT_SIG) {
+    // no usable FSINFO, counted by freeClusterScan()
+    m_fsInfoBlock = 0;
+    return;
+  }
+  if (pc->fsinfo.freeCount <= clusterCount()) {
+    // trusted for reporting until a scan confirms it
+    m_freeClusterCount = pc->fsinfo.freeCount;
+  }
+  if (pc->fsinfo.nextFree >= 2 && pc->fsinfo.nextFree <= m_lastCluster) {
+    m_allocSearchStart = pc->fsinfo.nextFree - 1;
+  }
+}
+//------------------------------------------------------------------------------
+bool FatVolume::fsInfoSync() {
+  cache_t* pc;
+  if (!m_fsInfoBlock || !m_freeCountDirty || m_freeClusterCount < 0) {
+    return true;
+  }
+  pc = cacheFetchData(m_fsInfoBlock, FatCache::CACHE_FOR_WRITE);
+  if (!pc) {
+    DBG_FAIL_MACRO;
+    return false;
+  }
+  pc->fsinfo.freeCount = m_freeClusterCount;
+  pc->fsinfo.nextFree = m_allocSearchStart + 1;
+  m_freeCountDirty = false;
+  return true;
+}
+#endif  // MAINTAIN_FREE_CLUSTER_COUNT
+//------------------------------------------------------------------------------
 bool FatVolume::init(uint8_t part) {
   uint32_t clusterCount;
   uint32_t totalBlocks;
   uint32_t volumeStartBlock = 0;
+  uint32_t fsInfoBlock = 0;
   fat32_boot_t* fbs;
   cache_t* pc;
   uint8_t tmp;
@@ -540,7 +833,12 @@ bool FatVolume::init(uint8_t part) {
   } else {
     m_rootDirStart = fbs->fat32RootCluster;
     m_fatType = 32;
+    if (fbs->fat32FSInfo) {
+      fsInfoBlock = volumeStartBlock + fbs->fat32FSInfo;
+    }
   }
+  freeIndexInit();
+  freeCountInit(fsInfoBlock);
   return true;
 
 fail:
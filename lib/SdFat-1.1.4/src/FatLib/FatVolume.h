@@ -91,7 +91,10 @@ union cache_t {
 //==============================================================================
 /**
  * \class FatCache
- * \brief Block cache.
+ * \brief Block cache of FAT_CACHE_BLOCKS blocks with LRU replacement.
+ *
+ * The block returned by the last read() is the current block, block(),
+ * dirty() and lbn() refer to it.
  */
 class FatCache {
  public:
@@ -113,11 +116,11 @@ class FatCache {
     = CACHE_STATUS_DIRTY | CACHE_OPTION_NO_READ;
   /** \return Cache block address. */
   cache_t* block() {
-    return &m_block;
+    return &m_block[m_current];
   }
   /** Set current block dirty. */
   void dirty() {
-    m_status |= CACHE_STATUS_DIRTY;
+    m_status[m_current] |= CACHE_STATUS_DIRTY;
   }
   /** Initialize the cache.
    * \param[in] vol FatVolume that owns this FatCache.
@@ -126,34 +129,76 @@ class FatCache {
     m_vol = vol;
     invalidate();
   }
-  /** Invalidate current cache block. */
+  /** Invalidate all cache blocks. */
   void invalidate() {
-    m_status = 0;
-    m_lbn = 0XFFFFFFFF;
+    for (uint8_t i = 0; i < FAT_CACHE_BLOCKS; i++) {
+      m_status[i] = 0;
+      m_lbn[i] = 0XFFFFFFFF;
+      m_used[i] = 0;
+    }
+    m_current = 0;
+  }
+  /** Invalidate cache blocks in a range, dirty data in it is dropped.
+   * \param[in] lbn First block of the range.
+   * \param[in] count Number of blocks in the range.
+   */
+  void invalidate(uint32_t lbn, uint32_t count) {
+    for (uint8_t i = 0; i < FAT_CACHE_BLOCKS; i++) {
+      if (m_lbn[i] - lbn < count) {
+        m_status[i] = 0;
+        m_lbn[i] = 0XFFFFFFFF;
+        m_used[i] = 0;
+      }
+    }
+  }
+  /** \return true if a block in the range is cached.
+   * \param[in] lbn First block of the range.
+   * \param[in] count Number of blocks in the range.
+   */
+  bool holds(uint32_t lbn, uint32_t count) {
+    for (uint8_t i = 0; i < FAT_CACHE_BLOCKS; i++) {
+      if (m_lbn[i] - lbn < count) {
+        return true;
+      }
+    }
+    return false;
   }
   /** \return dirty status */
   bool isDirty() {
-    return m_status & CACHE_STATUS_DIRTY;
+    return m_status[m_current] & CACHE_STATUS_DIRTY;
   }
   /** \return Logical block number for cached block. */
   uint32_t lbn() {
-    return m_lbn;
+    return m_lbn[m_current];
   }
   /** Read a block into the cache.
    * \param[in] lbn Block to read.
    * \param[in] option mode for cached block.
    * \return Address of cached block. */
   cache_t* read(uint32_t lbn, uint8_t option);
-  /** Write current block if dirty.
+  /** Write all dirty blocks.
    * \return true for success else false.
    */
   bool sync();
+  /** Write dirty data blocks, with FAT_CACHE_WRITE_BACK dirty FAT blocks
+   * are left for sync().
+   * \return true for success else false.
+   */
+  bool syncData();
 
  private:
-  uint8_t m_status;
+  bool held(uint8_t i) {
+    return FAT_CACHE_WRITE_BACK &&
+           (m_status[i] & CACHE_STATUS_MASK) == CACHE_STATUS_MASK;
+  }
+  bool syncBlock(uint8_t i);
   FatVolume* m_vol;
-  uint32_t m_lbn;
-  cache_t m_block;
+  uint32_t m_clock;
+  uint8_t m_current;
+  uint8_t m_status[FAT_CACHE_BLOCKS];
+  uint32_t m_lbn[FAT_CACHE_BLOCKS];
+  uint32_t m_used[FAT_CACHE_BLOCKS];
+  cache_t m_block[FAT_CACHE_BLOCKS];
 };
 //==============================================================================
 /**
@@ -164,7 +209,8 @@ class FatVolume {
  public:
   /** Create an instance of FatVolume
    */
-  FatVolume() : m_fatType(0) {}
+  FatVolume() : m_fatType(0), m_allocAlignStep(0),
+                m_freeIndexShift(FREE_INDEX_OFF) {}
 
   /** \return The volume's cluster size in blocks. */
   uint8_t blocksPerCluster() const {
@@ -184,6 +230,53 @@ class FatVolume {
     m_cache.invalidate();
     return m_cache.block();
   }
+  /** Drop cached copies of blocks written behind the volume's back,
+   * directly to the device or by another bus master.
+   *
+   * \param[in] block First block written.
+   * \param[in] count Number of blocks written.
+   */
+  void invalidateBlocks(uint32_t block, uint32_t count) {
+    m_cache.invalidate(block, count);
+#if USE_SEPARATE_FAT_CACHE
+    m_fatCache.invalidate(block, count);
+#endif  // USE_SEPARATE_FAT_CACHE
+    // a changed FAT may have freed or taken clusters anywhere
+    if (block < m_fatStartBlock + 2*m_blocksPerFat &&
+        block + count - 1 >= m_fatStartBlock) {
+      freeIndexReset();
+#if MAINTAIN_FREE_CLUSTER_COUNT
+      // keep the count as an estimate until it is counted again
+      m_freeCountValid = false;
+      m_freeScanBlock = 0;
+#endif  // MAINTAIN_FREE_CLUSTER_COUNT
+    }
+  }
+  /** Write all dirty cache blocks, FAT blocks to both FAT copies.
+   * Needed before another bus master uses the device.
+   * \return true for success else false.
+   */
+  bool cacheFlush() {
+    return cacheSync();
+  }
+  /** Write the free cluster count to FSINFO, if it changed, along with
+   * all dirty cache blocks.  Syncing a file does not write FSINFO, the
+   * caller decides how often the extra block write is worth it.
+   * \return true for success else false.
+   */
+  bool freeCountFlush() {
+    return fsInfoSync() && cacheSync();
+  }
+  /** \return true if the free cluster count changed since it was last
+   * written to FSINFO.
+   */
+  bool freeCountDirty() const {
+#if MAINTAIN_FREE_CLUSTER_COUNT
+    return m_fsInfoBlock && m_freeCountDirty && m_freeClusterCount >= 0;
+#else  // MAINTAIN_FREE_CLUSTER_COUNT
+    return false;
+#endif  // MAINTAIN_FREE_CLUSTER_COUNT
+  }
   /** \return The total number of clusters in the volume. */
   uint32_t clusterCount() const {
     return m_lastCluster - 1;
@@ -221,6 +314,42 @@ class FatVolume {
    * \return Count of free clusters for success or -1 if an error occurs.
    */
   int32_t freeClusterCount();
+  /** Free space as maintained, without reading the FAT.  For FAT32 the
+   * count is loaded from FSINFO and may be off until freeClusterScan()
+   * has confirmed it.
+   *
+   * \return Count of free clusters or -1 if not known.
+   */
+  int32_t freeClusterEstimate() const {
+#if MAINTAIN_FREE_CLUSTER_COUNT
+    return m_freeClusterCount;
+#else  // MAINTAIN_FREE_CLUSTER_COUNT
+    return -1;
+#endif  // MAINTAIN_FREE_CLUSTER_COUNT
+  }
+  /** \return true if the maintained free cluster count has been
+   * confirmed by a FAT scan, no scan is needed.
+   */
+  bool freeClusterCountValid() const {
+#if MAINTAIN_FREE_CLUSTER_COUNT
+    return m_freeCountValid;
+#else  // MAINTAIN_FREE_CLUSTER_COUNT
+    return true;
+#endif  // MAINTAIN_FREE_CLUSTER_COUNT
+  }
+  /** Count free clusters a few FAT blocks at a time, so the maintained
+   * count can be confirmed without a long stall.  FAT blocks not in the
+   * cache are read into \a buf, the cache contents are left in place.
+   * Clusters allocated or freed while the scan is under way are
+   * accounted for.
+   *
+   * \param[in] blocks Number of FAT blocks to read in this step.
+   * \param[in] buf A 512 byte, four byte aligned buffer.
+   *
+   * \return true once the count is confirmed, false while counting or
+   * if an error occurs.
+   */
+  bool freeClusterScan(uint32_t blocks, uint8_t* buf);
   /** Initialize a FAT volume.  Try partition one first then try super
    * floppy format.
    *
@@ -266,6 +395,15 @@ class FatVolume {
   uint32_t volumeSectorCount() const {
     return sectorsPerCluster()*clusterCount();
   }
+  /** Align the start of contiguous allocations, e.g. to the card's
+   * allocation unit, so large files begin on an erase boundary.
+   *
+   * \param[in] blocks Alignment in blocks. Zero, a size not a multiple of
+   * the cluster size or a data area that can't be aligned disables it.
+   *
+   * \return The value true is returned if alignment is in effect.
+   */
+  bool setContiguousAlignment(uint32_t blocks);
   /** Wipe all data from the volume.
    * \param[in] pr print stream for status dots.
    * \return true for success else false.
@@ -299,6 +437,27 @@ class FatVolume {
   uint32_t m_fatStartBlock;        // Start block for first FAT.
   uint32_t m_lastCluster;          // Last cluster number in FAT.
   uint32_t m_rootDirStart;         // Start block for FAT16, cluster for FAT32.
+  uint32_t m_allocAlignStep;       // Contiguous alignment in clusters, 0 if none.
+  uint32_t m_allocAlignFirst;      // First aligned cluster.
+//------------------------------------------------------------------------------
+  // free space index, two bits for each group of FAT blocks
+  static const uint8_t FREE_INDEX_UNKNOWN = 0;
+  static const uint8_t FREE_INDEX_FULL = 1;
+  static const uint8_t FREE_INDEX_EMPTY = 2;
+  static const uint8_t FREE_INDEX_MIXED = 3;
+  static const uint8_t FREE_INDEX_OFF = 0XFF;
+  uint8_t  m_freeIndexShift;       // Cluster to group shift, FREE_INDEX_OFF if none.
+#if FAT_FREE_INDEX_BYTES
+  uint8_t  m_freeIndex[FAT_FREE_INDEX_BYTES];
+#endif  // FAT_FREE_INDEX_BYTES
+  void freeIndexInit();
+  void freeIndexReset();
+  int8_t freeIndexState(uint32_t cluster);
+  void freeIndexUpdate(uint32_t cluster, bool free);
+  uint32_t freeIndexLast(uint32_t cluster) const {
+    uint32_t last = cluster | ((1UL << m_freeIndexShift) - 1);
+    return last < m_lastCluster ? last : m_lastCluster;
+  }
 //------------------------------------------------------------------------------
   // block I/O functions.
   bool readBlock(uint32_t block, uint8_t* dst) {
@@ -320,20 +479,51 @@ class FatVolume {
 #endif  // USE_MULTI_BLOCK_IO
 #if MAINTAIN_FREE_CLUSTER_COUNT
   int32_t  m_freeClusterCount;     // Count of free clusters in volume.
+  uint32_t m_fsInfoBlock;          // FAT32 FSINFO block, zero if none.
+  uint32_t m_freeScanBlock;        // Next FAT block for the counting scan.
+  uint32_t m_freeScanCount;        // Free clusters counted so far.
+  bool     m_freeCountDirty;       // Count changed since FSINFO was written.
+  bool     m_freeCountValid;       // Count confirmed by a FAT scan.
   void setFreeClusterCount(int32_t value) {
     m_freeClusterCount = value;
-  }
-  void updateFreeClusterCount(int32_t change) {
+    m_freeCountDirty = value >= 0;
+    m_freeCountValid = value >= 0;
+    m_freeScanBlock = 0;
+  }
+  // change is the number of clusters freed, negative for taken, starting
+  // at cluster
+  void updateFreeClusterCount(int32_t change, uint32_t cluster) {
+    uint32_t scanned;
+    uint32_t n;
     if (m_freeClusterCount >= 0) {
       m_freeClusterCount += change;
+      m_freeCountDirty = true;
+    }
+    // clusters the counting scan has passed are counted here
+    scanned = m_freeScanBlock << (fatType() == 16 ? 8 : 7);
+    if (cluster < scanned) {
+      n = change < 0 ? -change : change;
+      if (n > scanned - cluster) {
+        n = scanned - cluster;
+      }
+      m_freeScanCount += change < 0 ? -n : n;
     }
   }
+  void freeCountInit(uint32_t fsInfoBlock);
+  bool fsInfoSync();
 #else  // MAINTAIN_FREE_CLUSTER_COUNT
   void setFreeClusterCount(int32_t value) {
     (void)value;
   }
-  void updateFreeClusterCount(int32_t change) {
+  void updateFreeClusterCount(int32_t change, uint32_t cluster) {
     (void)change;
+    (void)cluster;
+  }
+  void freeCountInit(uint32_t fsInfoBlock) {
+    (void)fsInfoBlock;
+  }
+  bool fsInfoSync() {
+    return true;
   }
 #endif  // MAINTAIN_FREE_CLUSTER_COUNT
 
@@ -348,6 +538,9 @@ class FatVolume {
   bool cacheSync() {
     return m_cache.sync() && m_fatCache.sync() && syncBlocks();
   }
+  bool fatCacheHolds(uint32_t blockNumber) {
+    return m_fatCache.holds(blockNumber, 1);
+  }
 #else  //
   cache_t* cacheFetchFat(uint32_t blockNumber, uint8_t options) {
     return cacheFetchData(blockNumber,
@@ -356,6 +549,9 @@ class FatVolume {
   bool cacheSync() {
     return m_cache.sync() && syncBlocks();
   }
+  bool fatCacheHolds(uint32_t blockNumber) {
+    return m_cache.holds(blockNumber, 1);
+  }
 #endif  // USE_SEPARATE_FAT_CACHE
   cache_t* cacheFetchData(uint32_t blockNumber, uint8_t options) {
     return m_cache.read(blockNumber, options);
@@ -363,8 +559,14 @@ class FatVolume {
   void cacheInvalidate() {
     m_cache.invalidate();
   }
+  void cacheInvalidate(uint32_t blockNumber, uint32_t count) {
+    m_cache.invalidate(blockNumber, count);
+  }
+  bool cacheHolds(uint32_t blockNumber, uint32_t count = 1) {
+    return m_cache.holds(blockNumber, count);
+  }
   bool cacheSyncData() {
-    return m_cache.sync();
+    return m_cache.syncData();
   }
   cache_t *cacheAddress() {
     return m_cache.block();
@@ -382,6 +584,7 @@ class FatVolume {
   uint8_t blockOfCluster(uint32_t position) const {
     return (position >> 9) & m_clusterBlockMask;
   }
+  uint32_t alignCluster(uint32_t cluster) const;
   uint32_t clusterFirstBlock(uint32_t cluster) const;
   int8_t fatGet(uint32_t cluster, uint32_t* value);
   bool fatPut(uint32_t cluster, uint32_t value);
@@ -119,8 +119,11 @@
  * Set MAINTAIN_FREE_CLUSTER_COUNT nonzero to keep the count of free clusters
  * updated.  This will increase the speed of the freeClusterCount() call
  * after the first call.  Extra flash will be required.
+ *
+ * For FAT32 the count is loaded from the FSINFO sector at mount, confirmed
+ * by freeClusterScan() and written back by FatVolume::freeCountFlush().
  */
-#define MAINTAIN_FREE_CLUSTER_COUNT 0
+#define MAINTAIN_FREE_CLUSTER_COUNT 1
 //------------------------------------------------------------------------------
 /**
  * To enable SD card CRC checking set USE_SD_CRC nonzero.
@@ -189,6 +192,46 @@
 #define USE_SEPARATE_FAT_CACHE 0
 #endif  // __arm__
 //------------------------------------------------------------------------------
+/**
+ * Set FAT_CACHE_BLOCKS to the number of 512 byte blocks in a volume cache.
+ * Blocks are replaced least recently used first, so a directory walk keeps
+ * its directory block and the FAT block of its chain cached together.
+ * Each block costs about 520 bytes of RAM.
+ */
+#ifndef FAT_CACHE_BLOCKS
+#define FAT_CACHE_BLOCKS 4
+#endif  // FAT_CACHE_BLOCKS
+/**
+ * Set FAT_CACHE_WRITE_BACK nonzero to keep dirty FAT blocks in the cache
+ * until the volume is synced, by a file sync or close.  Flushing file data
+ * then no longer writes the FAT block and its mirror each time, and the
+ * FAT blocks are replaced only when nothing else can be.
+ */
+#ifndef FAT_CACHE_WRITE_BACK
+#define FAT_CACHE_WRITE_BACK 1
+#endif  // FAT_CACHE_WRITE_BACK
+/**
+ * Set FAT_FREE_INDEX_BYTES to the size of the free space index of a FAT16
+ * or FAT32 volume, zero to disable it.  The index keeps two bits per group
+ * of FAT blocks, telling whether the clusters of the group are all in use,
+ * all free or mixed.  Cluster allocation skips full groups and takes free
+ * groups without reading their FAT blocks.  Groups are classified the first
+ * time an allocation reaches them and are kept current by fatPut().
+ */
+#ifndef FAT_FREE_INDEX_BYTES
+#define FAT_FREE_INDEX_BYTES 1024
+#endif  // FAT_FREE_INDEX_BYTES
+/**
+ * Set FAT_EXTENT_MAP_RUNS to the number of runs of consecutive clusters a
+ * FatExtentMap holds.  A map attached to an open file is filled as the
+ * cluster chain is followed, after which seekSet() finds a position by a
+ * binary search of the runs and read() reads across cluster boundaries
+ * inside a run with one multi-block read.  Each run costs 12 bytes of RAM.
+ */
+#ifndef FAT_EXTENT_MAP_RUNS
+#define FAT_EXTENT_MAP_RUNS 8
+#endif  // FAT_EXTENT_MAP_RUNS
+//------------------------------------------------------------------------------
 /**
  * Set USE_MULTI_BLOCK_IO nonzero to use multi-block SD read/write.
  *
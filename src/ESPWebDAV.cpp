@@ -4,10 +4,11 @@
 #include <ESP8266WiFi.h>
 #include <SPI.h>
 #include <SdFat.h>
-#include <Hash.h>
-#include <time.h>
 #include "ESPWebDAV.h"
 
+// buffer size is critical *don't change*
+const size_t WRITE_BLOCK_CONST = 512;
+
 // define cal constants
 const char *months[]  = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 const char *wdays[]  = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
@@ -19,15 +20,51 @@ bool ESPWebDAV::init(int chipSelectPin, SPISettings spiSettings, int serverPort)
 	// start the wifi server
 	server = new WiFiServer(serverPort);
 	server->begin();
+	_outLen = 0;
+	_outRaw = 0;
+	for(uint8_t i = 0; i < DAV_MAX_CLIENTS; i++)
+		_conns[i]._listSlot = -1;
 
 	// initialize the SD card
-	return sd.begin(chipSelectPin, spiSettings);
+	if(!sd.begin(chipSelectPin, spiSettings))
+		return false;
+
+	_eraseBlocks = readEraseSize();
+	DBG_PRINT("Upload strategy: "); DBG_PRINT(DAV_UPLOAD_STRATEGY);
+	DBG_PRINT(", allocation unit: "); DBG_PRINT(_eraseBlocks); DBG_PRINTLN(" blocks");
+	return true;
 }
 
 // ------------------------
 bool ESPWebDAV::initSD(int chipSelectPin, SPISettings spiSettings) {
 	// initialize the SD card
-	return sd.begin(chipSelectPin, spiSettings);
+	if(!sd.begin(chipSelectPin, spiSettings))
+		return false;
+
+	_eraseBlocks = readEraseSize();
+	return true;
+}
+
+
+
+// ------------------------
+uint32_t ESPWebDAV::readEraseSize() {
+// ------------------------
+	// AU_SIZE of the SD status, 16KB doubling up to 4MB, then the SDXC steps up to 64MB
+	static const uint32_t auBlocks[] = { 0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072 };
+	uint8_t status[64];
+	if(sd.card()->readStatus(status) && (status[10] >> 4))
+		return auBlocks[status[10] >> 4];
+
+	// older cards only report the erase sector of the CSD, counted in write blocks of 2^WRITE_BL_LEN bytes
+	csd_t csd;
+	if(sd.card()->readCSD(&csd))	{
+		uint32_t sectorSize = ((csd.v1.sector_size_high << 1) | csd.v1.sector_size_low) + 1;
+		uint8_t writeBlLen = (csd.v1.write_bl_len_high << 2) | csd.v1.write_bl_len_low;
+		return (sectorSize << writeBlLen) / 512;
+	}
+
+	return 0;
 }
 
 // ------------------------
@@ -42,9 +79,9 @@ void ESPWebDAV::handleNotFound() {
 // ------------------------
 	String message = "Not found\n";
 	message += "URI: ";
-	message += uri;
+	message += conn->uri;
 	message += " Method: ";
-	message += method;
+	message += methodTable[conn->method].name;
 	message += "\n";
 
 	sendHeader("Allow", "OPTIONS,MKCOL,POST,PUT");
@@ -58,19 +95,25 @@ void ESPWebDAV::handleNotFound() {
 void ESPWebDAV::handleReject(String rejectMessage)	{
 // ------------------------
 	DBG_PRINT("Rejecting request: "); DBG_PRINTLN(rejectMessage);
+	// do not hold on to a client while the bus belongs to someone else
+	conn->_keepAlive = false;
+
+	// a change to the card is refused outright, before the client sends its body
+	if(methodTable[conn->method].modifiesListing)
+		return send("423 Locked", "text/plain", rejectMessage);
 
 	// handle options
-	if(method.equals("OPTIONS"))
+	if(conn->method == METHOD_OPTIONS)
 		return handleOptions(RESOURCE_NONE);
 
 	// handle properties
-	if(method.equals("PROPFIND"))	{
+	if(conn->method == METHOD_PROPFIND)	{
 		sendHeader("Allow", "PROPFIND,OPTIONS,DELETE,COPY,MOVE");
 		setContentLength(CONTENT_LENGTH_UNKNOWN);
 		send("207 Multi-Status", "application/xml;charset=utf-8", "");
 		sendContent(F("<?xml version=\"1.0\" encoding=\"utf-8\"?><D:multistatus xmlns:D=\"DAV:\"><D:response><D:href>/</D:href><D:propstat><D:status>HTTP/1.1 200 OK</D:status><D:prop><D:getlastmodified>Fri, 30 Nov 1979 00:00:00 GMT</D:getlastmodified><D:getetag>\"3333333333333333333333333333333333333333\"</D:getetag><D:resourcetype><D:collection/></D:resourcetype></D:prop></D:propstat></D:response>"));
 
-		if(depthHeader.equals("1"))	{
+		if(conn->depth == DEPTH_CHILD)	{
 			sendContent(F("<D:response><D:href>/"));
 			sendContent(rejectMessage);
 			sendContent(F("</D:href><D:propstat><D:status>HTTP/1.1 200 OK</D:status><D:prop><D:getlastmodified>Fri, 01 Apr 2016 16:07:40 GMT</D:getlastmodified><D:getetag>\"2222222222222222222222222222222222222222\"</D:getetag><D:resourcetype/><D:getcontentlength>0</D:getcontentlength><D:getcontenttype>application/octet-stream</D:getcontenttype></D:prop></D:propstat></D:response>"));
@@ -87,6 +130,11 @@ void ESPWebDAV::handleReject(String rejectMessage)	{
 
 
 
+// the table is defined in the class, indexing it at run time needs its storage here
+constexpr ESPWebDAV::TMethodEntry ESPWebDAV::methodTable[METHOD_COUNT];
+
+
+
 // set http_proxy=http://localhost:36036
 // curl -v -X PROPFIND -H "Depth: 1" http://Rigidbot/Old/PipeClip.gcode
 // Test PUT a file: curl -v -T c.txt -H "Expect:" http://Rigidbot/c.txt
@@ -94,18 +142,19 @@ void ESPWebDAV::handleReject(String rejectMessage)	{
 // ------------------------
 void ESPWebDAV::handleRequest(String blank)	{
 // ------------------------
+	const TMethodEntry &entry = methodTable[conn->method];
 	ResourceType resource = RESOURCE_NONE;
 
 	// does uri refer to a file or directory or a null?
 	FatFile tFile;
-	if(tFile.open(sd.vwd(), uri.c_str(), O_READ))	{
+	if(entry.needsResource && tFile.open(sd.vwd(), conn->uri, O_READ))	{
 		resource = tFile.isDir() ? RESOURCE_DIR : RESOURCE_FILE;
 		tFile.close();
 	}
 
-	DBG_PRINT("\r\nm: "); DBG_PRINT(method);
+	DBG_PRINT("\r\nm: "); DBG_PRINT(entry.name);
 	DBG_PRINT(" r: "); DBG_PRINT(resource);
-	DBG_PRINT(" u: "); DBG_PRINTLN(uri);
+	DBG_PRINT(" u: "); DBG_PRINTLN(conn->uri);
 
 	// add header that gets sent everytime
 	sendHeader("DAV", "1, 2");
@@ -115,48 +164,15 @@ void ESPWebDAV::handleRequest(String blank)	{
   sendHeader("Server", "ESPWebDAV (use Apache put range)");
   sendHeader("DAV", "<http://apache.org/dav/propset/fs/1>");
 
-	// handle properties
-	if(method.equals("PROPFIND"))
-		return handleProp(resource);
-
-	if(method.equals("GET"))
-		return handleGet(resource, true);
-
-	if(method.equals("HEAD"))
-		return handleGet(resource, false);
-
-	// handle options
-	if(method.equals("OPTIONS"))
-		return handleOptions(resource);
-
-	// handle file create/uploads
-	if(method.equals("PUT"))
-		return handlePut(resource);
-
-	// handle file locks
-	if(method.equals("LOCK"))
-		return handleLock(resource);
-
-	if(method.equals("UNLOCK"))
-		return handleUnlock(resource);
-
-	if(method.equals("PROPPATCH"))
-		return handlePropPatch(resource);
-
-	// directory creation
-	if(method.equals("MKCOL"))
-		return handleDirectoryCreate(resource);
-
-	// move a file or directory
-	if(method.equals("MOVE"))
-		return handleMove(resource);
+	// if no handler, means its a 404
+	if(!entry.handler)
+		return handleNotFound();
 
-	// delete a file or directory
-	if(method.equals("DELETE"))
-		return handleDelete(resource);
+	// cached directory listings are dropped before the card is changed
+	if(entry.modifiesListing)
+		invalidateListCache();
 
-	// if reached here, means its a 404
-	handleNotFound();
+	(this->*entry.handler)(resource);
 }
 
 
@@ -183,14 +199,14 @@ void ESPWebDAV::handleLock(ResourceType resource)	{
 	sendHeader("Allow", "PROPPATCH,PROPFIND,OPTIONS,DELETE,UNLOCK,COPY,LOCK,MOVE,HEAD,POST,PUT,GET");
 	sendHeader("Lock-Token", "urn:uuid:26e57cb3-834d-191a-00de-000042bdecf9");
 
-	size_t contentLen = contentLengthHeader.toInt();
+	// the body has arrived in CONN_BODY, nothing is waited for here
 	uint8_t buf[1024];
-	size_t numRead = readBytesWithTimeout(buf, sizeof(buf), contentLen);
+	size_t numRead = readRequestBody(buf, sizeof(buf) - 1);
 
 	if(numRead == 0)
 		return handleNotFound();
 
-	buf[contentLen] = 0;
+	buf[numRead] = 0;
 	String inXML = String((char*) buf);
 	int startIdx = inXML.indexOf("<D:href>");
 	int endIdx = inXML.indexOf("</D:href>");
@@ -202,7 +218,7 @@ void ESPWebDAV::handleLock(ResourceType resource)	{
 	String resp2 = F("</D:href></D:lockroot><D:depth>infinity</D:depth><D:owner><a:href xmlns:a=\"DAV:\">");
 	String resp3 = F("</a:href></D:owner><D:timeout>Second-3600</D:timeout></D:activelock></D:lockdiscovery></D:prop>");
 
-	send("200 OK", "application/xml;charset=utf-8", resp1 + uri + resp2 + lockUser + resp3);
+	send("200 OK", "application/xml;charset=utf-8", resp1 + conn->uri + resp2 + lockUser + resp3);
 }
 
 
@@ -232,11 +248,7 @@ void ESPWebDAV::handleProp(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing PROPFIND");
 	// check depth header
-	DepthType depth = DEPTH_NONE;
-	if(depthHeader.equals("1"))
-		depth = DEPTH_CHILD;
-	else if(depthHeader.equals("infinity"))
-		depth = DEPTH_ALL;
+	DepthType depth = conn->depth;
 
 	DBG_PRINT("Depth: "); DBG_PRINTLN(depth);
 
@@ -255,18 +267,31 @@ void ESPWebDAV::handleProp(ResourceType resource)	{
 	sendContent(F("<D:multistatus xmlns:D=\"DAV:\">"));
 
 	// open this resource
-	SdFile baseFile;
-	baseFile.open(uri.c_str(), O_READ);
-	sendPropResponse(false, &baseFile);
-
-	if((resource == RESOURCE_DIR) && (depth == DEPTH_CHILD))	{
-		// append children information to message
-		SdFile childFile;
-		while(childFile.openNext(&baseFile, O_READ)) {
-			yield();
-			sendPropResponse(true, &childFile);
-			childFile.close();
+	SdFile &baseFile = conn->file;
+	baseFile.open(conn->uri, O_READ);
+	DAVListRecord rec;
+	readPropRecord(&baseFile, &rec, NULL, 0);
+	sendPropResponse(false, &rec, NULL);
+
+	// children information is appended over the next passes
+	if((resource == RESOURCE_DIR) && (depth != DEPTH_NONE))	{
+		strcpy(conn->_propPath, conn->uri);
+		conn->_propDepth = 0;
+		conn->_propEntries = 0;
+		conn->_propTruncated = false;
+		conn->_listSlot = -1;
+		conn->_listReplay = false;
+
+		// a Depth 1 listing seen before is replayed from RAM, otherwise it is recorded
+		if(depth == DEPTH_CHILD)	{
+			conn->_listPos = 0;
+			conn->_listReplay = findListing(baseFile.firstCluster());
+			if(conn->_listReplay)
+				baseFile.close();
+			else
+				claimListing(baseFile.firstCluster());
 		}
+		return startStream(&ESPWebDAV::sendPropSlice);
 	}
 
 	baseFile.close();
@@ -276,61 +301,187 @@ void ESPWebDAV::handleProp(ResourceType resource)	{
 
 
 // ------------------------
-void ESPWebDAV::sendPropResponse(boolean recursing, FatFile *curFile)	{
+bool ESPWebDAV::sendPropSlice()	{
 // ------------------------
-	char buf[255];
-	curFile->getName(buf, sizeof(buf));
+	if(conn->_listReplay)
+		return sendCachedPropSlice();
+
+	// depth first walk, one directory entry per step and no recursion
+	SdFile childFile;
+	DAVListRecord rec;
+	char name[255];
+	for(uint8_t n = 0; n < DAV_PROP_SLICE; n++)	{
+		FatFile *dir = conn->_propDepth ? &conn->_propStack[conn->_propDepth - 1] : &conn->file;
+		// a directory that could still be descended into is opened in place on the stack
+		bool canDescend = (conn->depth == DEPTH_ALL) && (conn->_propDepth < DAV_PROPFIND_MAX_DEPTH);
+		FatFile *child = canDescend ? &conn->_propStack[conn->_propDepth] : &childFile;
+
+		if(!child->openNext(dir, O_READ))	{
+			if(!conn->_propDepth)	{
+				commitListing();
+				closePropWalk(conn);
+				finishPropWalk();
+				return true;
+			}
+			// done with this level, back to its parent
+			dir->close();
+			conn->_propDepth--;
+			conn->_propPath[conn->_propPathLen[conn->_propDepth]] = 0;
+			continue;
+		}
+
+		if(++conn->_propEntries > DAV_PROPFIND_MAX_ENTRIES)	{
+			child->close();
+			conn->_propTruncated = true;
+			closePropWalk(conn);
+			finishPropWalk();
+			return true;
+		}
+
+		readPropRecord(child, &rec, name, sizeof(name));
+		// uploads still in progress are not listed
+		if(child->isHidden() && !strncmp(name, DAV_TEMP_PREFIX, sizeof(DAV_TEMP_PREFIX) - 1))	{
+			child->close();
+			continue;
+		}
+		sendPropResponse(true, &rec, name);
+		recordListing(&rec, name);
+
+		if(!rec.isDir || conn->depth != DEPTH_ALL)	{
+			child->close();
+			continue;
+		}
+
+		// descend, its path is needed for the href of everything below it
+		size_t pathLen = strlen(conn->_propPath);
+		size_t nameStart = (pathLen && conn->_propPath[pathLen - 1] == '/') ? pathLen : pathLen + 1;
+		if(!canDescend || nameStart + rec.nameLen >= sizeof(conn->_propPath))	{
+			conn->_propTruncated = true;
+			child->close();
+			continue;
+		}
+		conn->_propPath[nameStart - 1] = '/';
+		strcpy(conn->_propPath + nameStart, name);
+		conn->_propPathLen[conn->_propDepth] = pathLen;
+		conn->_propDepth++;
+	}
+	return false;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::sendCachedPropSlice()	{
+// ------------------------
+	// records are copied out as they may sit unaligned in the slot
+	DAVListing &slot = _listings[conn->_listSlot];
+	DAVListRecord rec;
+	for(uint8_t n = 0; n < DAV_PROP_SLICE; n++)	{
+		if(conn->_listPos >= slot.length)	{
+			closePropWalk(conn);
+			finishPropWalk();
+			return true;
+		}
+		memcpy(&rec, slot.data + conn->_listPos, sizeof(rec));
+		const char *name = (const char *) slot.data + conn->_listPos + sizeof(rec);
+		sendPropResponse(true, &rec, name);
+		conn->_listPos += sizeof(rec) + rec.nameLen + 1;
+	}
+	return false;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::closePropWalk(DAVConnection *c)	{
+// ------------------------
+	while(c->_propDepth)
+		c->_propStack[--c->_propDepth].close();
+	if(c->file.isOpen())
+		c->file.close();
+	releaseListing(c);
+}
+
+
+
+// ------------------------
+void ESPWebDAV::finishPropWalk()	{
+// ------------------------
+	// a listing cut short by the depth or entry limit says so, as RFC 4918 suggests
+	if(conn->_propTruncated)	{
+		DBG_PRINTLN("PROPFIND truncated");
+		sendContent(F("<D:response><D:href>"));
+		sendContent(conn->uri);
+		sendContent(F("</D:href><D:status>HTTP/1.1 507 Insufficient Storage</D:status></D:response>"));
+	}
+	sendContent(F("</D:multistatus>"));
+}
 
-// String fullResPath = "http://" + hostHeader + uri;
-	String fullResPath = uri;
 
-	if(recursing)
-		if(fullResPath.endsWith("/"))
-			fullResPath += String(buf);
-		else
-			fullResPath += "/" + String(buf);
 
-	// get file modified time
+// ------------------------
+void ESPWebDAV::readPropRecord(FatFile *curFile, DAVListRecord *rec, char *name, size_t nameSize)	{
+// ------------------------
+	// the root has no directory entry and reports zero stamps
 	dir_t dir;
+	memset(&dir, 0, sizeof(dir));
 	curFile->dirEntry(&dir);
 
-	// convert to required format
-	tm tmStr;
-	tmStr.tm_hour = FAT_HOUR(dir.lastWriteTime);
-	tmStr.tm_min = FAT_MINUTE(dir.lastWriteTime);
-	tmStr.tm_sec = FAT_SECOND(dir.lastWriteTime);
-	tmStr.tm_year = FAT_YEAR(dir.lastWriteDate) - 1900;
-	tmStr.tm_mon = FAT_MONTH(dir.lastWriteDate) - 1;
-	tmStr.tm_mday = FAT_DAY(dir.lastWriteDate);
-	time_t t2t = mktime(&tmStr);
-	tm *gTm = gmtime(&t2t);
+	rec->cluster = curFile->firstCluster();
+	rec->size = dir.fileSize;
+	rec->date = dir.lastWriteDate;
+	rec->time = dir.lastWriteTime;
+	rec->isDir = curFile->isDir();
+	rec->nameLen = 0;
+	if(name)	{
+		curFile->getName(name, nameSize);
+		rec->nameLen = strlen(name);
+	}
+}
+
 
-	// Tue, 13 Oct 2015 17:07:35 GMT
-	sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT", wdays[gTm->tm_wday], gTm->tm_mday, months[gTm->tm_mon], gTm->tm_year + 1900, gTm->tm_hour, gTm->tm_min, gTm->tm_sec);
-	String fileTimeStamp = String(buf);
 
+// ------------------------
+void ESPWebDAV::sendPropResponse(boolean recursing, const DAVListRecord *rec, const char *name)	{
+// ------------------------
+	// every field comes from the record, nothing is allocated per entry
+	char buf[40];
 
 	// send the XML information about thyself to client
 	sendContent(F("<D:response><D:href>"));
-	// append full file path
-	sendContent(fullResPath);
+	// append full file path, the collection followed by the child name
+	const char *path = recursing ? conn->_propPath : conn->uri;
+	sendContent(path);
+	if(recursing)	{
+		size_t pathLen = strlen(path);
+		if(!pathLen || path[pathLen - 1] != '/')
+			sendContent("/");
+		sendContent(name);
+	}
 	sendContent(F("</D:href><D:propstat><D:status>HTTP/1.1 200 OK</D:status><D:prop><D:getlastmodified>"));
 	// append modified date
-	sendContent(fileTimeStamp);
+	formatHttpDate(buf, rec->date, rec->time);
+	sendContent(buf);
 	sendContent(F("</D:getlastmodified><D:getetag>"));
-	// append unique tag generated from full path
-	sendContent("\"" + sha1(fullResPath + fileTimeStamp) + "\"");
+	// append tag derived from the entry itself
+	formatETag(buf, rec->cluster, rec->size, rec->date, rec->time);
+	sendContent(buf);
 	sendContent(F("</D:getetag>"));
 
-	if(curFile->isDir())
+	if(rec->isDir)	{
 		sendContent(F("<D:resourcetype><D:collection/></D:resourcetype>"));
+		// free space for the requested collection only, Explorer asks for it there
+		if(!recursing)
+			sendQuotaProps();
+	}
 	else	{
 		sendContent(F("<D:resourcetype/><D:getcontentlength>"));
 		// append the file size
-		sendContent(String(curFile->fileSize()));
+		sprintf(buf, "%lu", (unsigned long) rec->size);
+		sendContent(buf);
 		sendContent(F("</D:getcontentlength><D:getcontenttype>"));
 		// append correct file mime type
-		sendContent(getMimeType(fullResPath));
+		sendContent(getMimeType(recursing ? name : conn->uri));
 		sendContent(F("</D:getcontenttype>"));
 	}
 	sendContent(F("</D:prop></D:propstat></D:response>"));
@@ -338,6 +489,256 @@ void ESPWebDAV::sendPropResponse(boolean recursing, FatFile *curFile)	{
 
 
 
+// ------------------------
+void ESPWebDAV::sendQuotaProps()	{
+// ------------------------
+	// RFC 4331 quota from the count the volume maintains, the FAT is not read here
+	int32_t freeClusters = sd.vol()->freeClusterEstimate();
+	if(freeClusters < 0)
+		return;
+
+	char buf[24];
+	uint64_t clusterBytes = (uint64_t) sd.vol()->blocksPerCluster() * WRITE_BLOCK_CONST;
+	sendContent(F("<D:quota-available-bytes>"));
+	formatBytes(buf, clusterBytes * freeClusters);
+	sendContent(buf);
+	sendContent(F("</D:quota-available-bytes><D:quota-used-bytes>"));
+	formatBytes(buf, clusterBytes * (sd.vol()->clusterCount() - freeClusters));
+	sendContent(buf);
+	sendContent(F("</D:quota-used-bytes>"));
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::findListing(uint32_t cluster)	{
+// ------------------------
+	for(uint8_t i = 0; i < DAV_LIST_CACHE_SLOTS; i++)	{
+		DAVListing &slot = _listings[i];
+		if(slot.valid && slot.cluster == cluster)	{
+			DBG_PRINTLN("Listing from cache");
+			slot.users++;
+			slot.lastUsed = millis();
+			conn->_listSlot = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::claimListing(uint32_t cluster)	{
+// ------------------------
+	// an unused slot, or else the least recently used one no connection is reading
+	int8_t found = -1;
+	for(uint8_t i = 0; i < DAV_LIST_CACHE_SLOTS; i++)	{
+		DAVListing &slot = _listings[i];
+		if(slot.users)
+			continue;
+		if(found < 0 || !slot.valid || (_listings[found].valid && slot.lastUsed < _listings[found].lastUsed))
+			found = i;
+		if(!slot.valid)
+			break;
+	}
+	if(found < 0)
+		return;
+
+	DAVListing &slot = _listings[found];
+	slot.valid = false;
+	slot.cluster = cluster;
+	slot.length = 0;
+	slot.users = 1;
+	conn->_listSlot = found;
+	conn->_listGeneration = _listGeneration;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::recordListing(const DAVListRecord *rec, const char *name)	{
+// ------------------------
+	if(conn->_listSlot < 0 || conn->_listReplay)
+		return;
+
+	// a listing that does not fit is not cached at all
+	DAVListing &slot = _listings[conn->_listSlot];
+	size_t recLen = sizeof(*rec) + rec->nameLen + 1;
+	if(slot.length + recLen > sizeof(slot.data))	{
+		releaseListing(conn);
+		return;
+	}
+	memcpy(slot.data + slot.length, rec, sizeof(*rec));
+	memcpy(slot.data + slot.length + sizeof(*rec), name, rec->nameLen + 1);
+	slot.length += recLen;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::commitListing()	{
+// ------------------------
+	// only if nothing was changed on the card while it was being read
+	if(conn->_listSlot < 0 || conn->_listReplay || conn->_listGeneration != _listGeneration)
+		return;
+
+	DAVListing &slot = _listings[conn->_listSlot];
+	slot.valid = true;
+	slot.lastUsed = millis();
+}
+
+
+
+// ------------------------
+void ESPWebDAV::releaseListing(DAVConnection *c)	{
+// ------------------------
+	if(c->_listSlot < 0)
+		return;
+
+	_listings[c->_listSlot].users--;
+	c->_listSlot = -1;
+	c->_listReplay = false;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::invalidateBlockCache()	{
+// ------------------------
+	// FAT and directory blocks held by the volume cache may have been rewritten
+	sd.vol()->invalidateBlocks(0, 0XFFFFFFFF);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::flushBlockCache()	{
+// ------------------------
+	// FAT updates held back by the volume cache, written to both FAT copies
+	if(!sd.vol()->fatType())
+		return true;
+	// a changed free count goes to FSINFO now and then, not with every file closed
+	if(sd.vol()->freeCountDirty() && millis() - _fsInfoWritten >= DAV_FSINFO_INTERVAL)	{
+		_fsInfoWritten = millis();
+		return sd.vol()->freeCountFlush();
+	}
+	return sd.vol()->cacheFlush();
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::wantsFreeCount()	{
+// ------------------------
+	// the quota count is confirmed, and a changed one stored, only while nobody is being served
+	if(!sd.vol()->fatType() || hasClients())
+		return false;
+	return !sd.vol()->freeClusterCountValid() || (sd.vol()->freeCountDirty() && millis() - _fsInfoWritten >= DAV_FSINFO_INTERVAL);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::countFreeSpace()	{
+// ------------------------
+	// a confirmed count only has to reach FSINFO, releasing the bus writes it
+	if(sd.vol()->freeClusterCountValid())
+		return true;
+	// FAT blocks the volume cache does not hold go through an idle transfer buffer,
+	// so the blocks cached for the next requests stay
+	for(uint8_t i = 0; i < DAV_XFER_BUFFERS; i++)
+		if(!_xferBufferOwner[i])
+			return sd.vol()->freeClusterScan(DAV_FREE_SCAN_BLOCKS, _xferBuffers[i]);
+	return false;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::invalidateListCache()	{
+// ------------------------
+	// listings being recorded right now are not committed either
+	for(uint8_t i = 0; i < DAV_LIST_CACHE_SLOTS; i++)
+		_listings[i].valid = false;
+	_listGeneration++;
+	// whatever changed a directory may have moved or regrown a file too
+	for(uint8_t i = 0; i < DAV_RAW_CACHE_SLOTS; i++)
+		_rawFiles[i].cluster = 0;
+}
+
+
+
+// ------------------------
+uint32_t ESPWebDAV::rawFirstBlock(FatFile &file)	{
+// ------------------------
+	// the FAT chain is walked once per file, a repeated GET finds the answer here
+	uint32_t cluster = file.firstCluster();
+	if(!cluster)
+		return 0;
+	for(uint8_t i = 0; i < DAV_RAW_CACHE_SLOTS; i++)
+		if(_rawFiles[i].cluster == cluster)
+			return _rawFiles[i].firstBlock;
+
+	uint32_t bgnBlock, endBlock;
+	DAVRawEntry &entry = _rawFiles[_nextRawFile];
+	_nextRawFile = (_nextRawFile + 1) % DAV_RAW_CACHE_SLOTS;
+	entry.cluster = cluster;
+	entry.firstBlock = file.contiguousRange(&bgnBlock, &endBlock) ? bgnBlock : 0;
+	return entry.firstBlock;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::formatHttpDate(char *buf, uint16_t fatDate, uint16_t fatTime)	{
+// ------------------------
+	// FAT stamps carry no zone and are served as GMT
+	int year = FAT_YEAR(fatDate);
+	int month = FAT_MONTH(fatDate);
+	int day = FAT_DAY(fatDate);
+	if(month < 1 || month > 12)
+		month = 1;
+	if(day < 1)
+		day = 1;
+
+	// day of the week without going through mktime, Sakamoto's method
+	static const uint8_t monthOffset[] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+	int y = (month < 3) ? year - 1 : year;
+	int wday = (y + y/4 - y/100 + y/400 + monthOffset[month - 1] + day) % 7;
+
+	// Tue, 13 Oct 2015 17:07:35 GMT
+	sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT", wdays[wday], day, months[month - 1], year, FAT_HOUR(fatTime), FAT_MINUTE(fatTime), FAT_SECOND(fatTime));
+}
+
+
+
+// ------------------------
+void ESPWebDAV::formatETag(char *buf, uint32_t cluster, uint32_t size, uint16_t fatDate, uint16_t fatTime)	{
+// ------------------------
+	// first cluster, size and modify stamp change whenever the content is replaced
+	sprintf(buf, "\"%lx-%lx-%04x%04x\"", (unsigned long) cluster, (unsigned long) size, fatDate, fatTime);
+}
+
+
+
+// ------------------------
+void ESPWebDAV::formatBytes(char *buf, uint64_t bytes)	{
+// ------------------------
+	// volumes pass 4GB, and printf has no 64 bit conversion here
+	char digits[21];
+	int n = 0;
+	do	{
+		digits[n++] = '0' + bytes % 10;
+		bytes /= 10;
+	} while(bytes);
+	while(n)
+		*buf++ = digits[--n];
+	*buf = 0;
+}
+
+
+
 
 // ------------------------
 void ESPWebDAV::handleGet(ResourceType resource, bool isGet)	{
@@ -348,66 +749,188 @@ void ESPWebDAV::handleGet(ResourceType resource, bool isGet)	{
 	if(resource != RESOURCE_FILE)
 		return handleNotFound();
 
-	SdFile rFile;
-	long tStart = millis();
-	uint8_t buf[1460];
-	rFile.open(uri.c_str(), O_READ);
+	SdFile &rFile = conn->file;
+	conn->_transferStart = millis();
+	rFile.open(conn->uri, O_READ);
 
 	sendHeader("Allow", "PROPFIND,OPTIONS,DELETE,COPY,MOVE,HEAD,POST,PUT,GET");
- 	size_t fileSize;
- 	if (_contentRangeStart==CONTENT_RANGE_NOT_SET && _contentRangeEnd==CONTENT_RANGE_NOT_SET)
- 	{
- 	  fileSize=rFile.fileSize();
- 	}
- 	else
- 	{
- 	  fileSize=_contentRangeEnd-_contentRangeStart+1;
-    sendHeader("Accept-Ranges", "bytes");
-    sendHeader("Content-Range", "bytes "+String(_contentRangeStart)+"-"+String(_contentRangeEnd)+"/"+String(rFile.fileSize()));
- 	}
-  setContentLength(fileSize);
-
-	String contentType = getMimeType(uri);
-	if(uri.endsWith(".gz") && contentType != "application/x-gzip" && contentType != "application/octet-stream")
+
+	// validators come from the directory entry, the same ones PROPFIND reports
+	dir_t dir;
+	char etag[32], modified[32];
+	rFile.dirEntry(&dir);
+	formatETag(etag, rFile.firstCluster(), dir.fileSize, dir.lastWriteDate, dir.lastWriteTime);
+	formatHttpDate(modified, dir.lastWriteDate, dir.lastWriteTime);
+	sendHeader("ETag", etag);
+	sendHeader("Last-Modified", modified);
+
+	// a client revalidating its copy is answered without reading the file
+	if(isNotModified(&dir, etag))	{
+		DBG_PRINTLN("Not modified");
+		setContentLength(rFile.fileSize());
+		send("304 Not Modified", NULL, "");
+		rFile.close();
+		return;
+	}
+
+	const char *contentType = getMimeType(conn->uri);
+	size_t uriLen = strlen(conn->uri);
+	if(uriLen > 3 && !strcmp(conn->uri + uriLen - 3, ".gz") && strcmp(contentType, "application/x-gzip") && strcmp(contentType, "application/octet-stream"))
 		sendHeader("Content-Encoding", "gzip");
+	sendHeader("Accept-Ranges", "bytes");
+
+	// a Range header none of whose ranges lie within the file
+	size_t fileSize = rFile.fileSize();
+	if(conn->_rangeCount && !resolveRanges(fileSize))	{
+		DBG_PRINTLN("Range not satisfiable");
+		sendHeader("Content-Range", "bytes */" + String(fileSize));
+		send("416 Range Not Satisfiable", NULL, "");
+		rFile.close();
+		return;
+	}
 
-  if (!isGet)
-  	send("200 OK", contentType.c_str(), "");
+	// a whole file is sent as the single range covering it
+	bool partial = (conn->_rangeCount > 0);
+	const char *status = partial ? "206 Partial Content" : "200 OK";
+	if(!partial)	{
+		conn->_ranges[0].first = 0;
+		conn->_ranges[0].last = fileSize - 1;
+		conn->_rangeCount = fileSize ? 1 : 0;
+	}
+	conn->_rangeIndex = 0;
+	conn->_multipart = (conn->_rangeCount > 1);
+
+	size_t length = 0;
+	if(conn->_multipart)	{
+		// every part carries its own header, the total is known before the first byte
+		char partHeader[DAV_PART_HEADER];
+		for(uint8_t i = 0; i < conn->_rangeCount; i++)
+			length += formatPartHeader(partHeader, i, contentType, fileSize) + conn->_ranges[i].last - conn->_ranges[i].first + 1;
+		length += strlen("\r\n--" DAV_BYTERANGES_BOUNDARY "--\r\n");
+		setContentLength(length);
+		send(status, "multipart/byteranges; boundary=" DAV_BYTERANGES_BOUNDARY, "");
+	}
+	else	{
+		if(conn->_rangeCount)
+			length = conn->_ranges[0].last - conn->_ranges[0].first + 1;
+		if(partial)
+			sendHeader("Content-Range", "bytes " + String(conn->_ranges[0].first) + "-" + String(conn->_ranges[0].last) + "/" + String(fileSize));
+		setContentLength(length);
+		send(status, contentType, "");
+	}
 
-	if(isGet)
-	{
+	if(!isGet || !length)	{
+		rFile.close();
+		return;
+	}
 
-		// disable Nagle if buffer size > TCP MTU of 1460
-		// client.setNoDelay(1);
-
-    if (_contentRangeStart==CONTENT_RANGE_NOT_SET && _contentRangeEnd==CONTENT_RANGE_NOT_SET)
-    {
-      send("200 OK", contentType.c_str(), "");
-  		// send the whole file
-  		while(rFile.available())
-  		{
-  			// SD read speed ~ 17sec for 4.5MB file
-  			int numRead = rFile.read(buf, sizeof(buf));
-  			client.write(buf, numRead);
-  		}
-    }
-    else
-    {
-      send("206 Partial Content", contentType.c_str(), "");
-      // send the selected range
-      rFile.seekSet(_contentRangeStart);
-      size_t remaining=fileSize;
-      while (remaining>0)
-      {
-        int numRead=rFile.read(buf, (sizeof(buf)<remaining)?sizeof(buf):remaining);
-        client.write(buf, numRead);
-        remaining-=numRead;
-      }
-    }
-	}
-
-	rFile.close();
-	DBG_PRINT("File "); DBG_PRINT(fileSize); DBG_PRINT(" bytes sent in: "); DBG_PRINT((millis() - tStart)/1000); DBG_PRINTLN(" sec");
+	// disable Nagle if buffer size > TCP MTU of 1460
+	// client.setNoDelay(1);
+
+	// the body is streamed in slices over the next passes of processClient
+	DBG_PRINT("File "); DBG_PRINT(length); DBG_PRINTLN(" bytes to send");
+	conn->_sendLength = length;
+	claimTransferBuffers();
+
+	// a contiguous file, like every upload stored by handlePut, is read as raw blocks
+	conn->_rawBlock = conn->_rawFirst = 0;
+	conn->_rawOpen = false;
+	if(conn->_xferBuf[0])
+		conn->_rawFirst = rawFirstBlock(rFile);
+	if(conn->_rawFirst)	{
+		DBG_PRINTLN("Contiguous file, reading raw blocks");
+	}
+	else
+		// a fragmented file keeps its cluster runs, ranges seek without walking the chain
+		rFile.setExtentMap(&conn->_extentMap);
+
+	startRange();
+	startStream(&ESPWebDAV::sendFileSlice);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::resolveRanges(size_t fileSize)	{
+// ------------------------
+	// suffix and open ended ranges become absolute, ranges beyond the end are dropped
+	uint8_t n = 0;
+	for(uint8_t i = 0; i < conn->_rangeCount; i++)	{
+		DAVRange r = conn->_ranges[i];
+		if(r.first == DAV_RANGE_OPEN)	{
+			if(!r.last || !fileSize)
+				continue;
+			r.first = (r.last >= fileSize) ? 0 : fileSize - r.last;
+			r.last = fileSize - 1;
+		}
+		else	{
+			if(r.first >= fileSize)
+				continue;
+			if(r.last >= fileSize)
+				r.last = fileSize - 1;
+		}
+		conn->_ranges[n++] = r;
+	}
+
+	conn->_rangeCount = n;
+	return n > 0;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::startRange()	{
+// ------------------------
+	const DAVRange &r = conn->_ranges[conn->_rangeIndex];
+	conn->_sendRemaining = r.last - r.first + 1;
+
+	if(conn->_rawFirst)	{
+		conn->_rawBlock = conn->_rawFirst + r.first / 512;
+		conn->_rawSkip = r.first % 512;
+	}
+	else
+		conn->file.seekSet(r.first);
+
+	// goes out ahead of the part's data, the output buffer is flushed before file data
+	if(conn->_multipart)	{
+		char partHeader[DAV_PART_HEADER];
+		formatPartHeader(partHeader, conn->_rangeIndex, getMimeType(conn->uri), conn->file.fileSize());
+		sendContent(partHeader);
+	}
+}
+
+
+
+// ------------------------
+size_t ESPWebDAV::formatPartHeader(char *buf, uint8_t index, const char *contentType, size_t fileSize)	{
+// ------------------------
+	const DAVRange &r = conn->_ranges[index];
+	return snprintf(buf, DAV_PART_HEADER, "\r\n--" DAV_BYTERANGES_BOUNDARY "\r\nContent-Type: %s\r\nContent-Range: bytes %lu-%lu/%lu\r\n\r\n",
+		contentType, (unsigned long) r.first, (unsigned long) r.last, (unsigned long) fileSize);
+}
+
+
+
+// ------------------------
+void ESPWebDAV::handleGet(ResourceType resource)	{
+// ------------------------
+	handleGet(resource, true);
+}
+
+
+
+// ------------------------
+void ESPWebDAV::handleHead(ResourceType resource)	{
+// ------------------------
+	// a resumable upload in progress tells how much of it is stored
+	int8_t slot = findUpload(conn->uri);
+	if(slot >= 0)	{
+		sendUploadOffset(slot);
+		sendHeader("Cache-Control", "no-store");
+		if(resource != RESOURCE_FILE)
+			return send("204 No Content", NULL, "");
+	}
+	handleGet(resource, false);
 }
 
 
@@ -420,136 +943,768 @@ void ESPWebDAV::handlePut(ResourceType resource)	{
 	if(resource == RESOURCE_DIR)
 		return handleNotFound();
 
-	SdFile nFile;
+	SdFile &nFile = conn->file;
 	sendHeader("Allow", "PROPFIND,OPTIONS,DELETE,COPY,MOVE,HEAD,POST,PUT,GET");
 
+	// a whole body goes to a temporary file, only an empty body or a range is written in place
+	bool ranged = (conn->_contentRangeStart != CONTENT_RANGE_NOT_SET || conn->_contentRangeEnd != CONTENT_RANGE_NOT_SET);
+	bool resumable = ranged && conn->_contentRangeTotal != (int) CONTENT_RANGE_NOT_SET;
+	bool whole = conn->_chunkedBody || (conn->_requestLength && !ranged) || resumable;
+	// a failed upload only deletes a file this request created
+	conn->_resource = resource;
+	conn->_inPlaceSize = (uint32_t) -1;
+
 	// if file does not exist, create it
 	if(resource == RESOURCE_NONE)	{
-		if(!nFile.open(uri.c_str(), O_CREAT | O_WRITE))
+		// the parent collection has to exist
+		char *slash = strrchr(conn->uri, '/');
+		if(slash && slash != conn->uri)	{
+			FatFile parent;
+			*slash = 0;
+			bool exists = parent.open(sd.vwd(), conn->uri, O_READ) && parent.isDir();
+			*slash = '/';
+			if(!exists)
+				return send("409 Conflict", "text/plain", "Parent collection does not exist");
+		}
+		if(!whole && !nFile.open(conn->uri, O_CREAT | O_WRITE))
 			return handleWriteError("Unable to create a new file", &nFile);
 	}
 
 	// file is created/open for writing at this point
-	DBG_PRINT(uri); DBG_PRINTLN(" - ready for data");
+	DBG_PRINT(conn->uri); DBG_PRINTLN(" - ready for data");
 	// did server send any data in put
-	size_t contentLen = contentLengthHeader.toInt();
+	size_t contentLen = conn->_requestLength;
+
+	conn->_transferStart = millis();
+	conn->_recvLength = conn->_recvRemaining = contentLen;
 
-	if (_contentRangeStart==CONTENT_RANGE_NOT_SET && _contentRangeEnd==CONTENT_RANGE_NOT_SET)
+	// a chunked body tells its length only by ending
+	if(conn->_chunkedBody)	{
+		if(ranged)
+			return send("411 Length Required", NULL, "");
+		return startChunkedPut(nFile);
+	}
+
+	// a range with a known total is part of a resumable upload, one with "/*" updates in place
+	if(resumable)
+		return startResumablePut(nFile);
+
+	if (!ranged)
 	{
 		if(contentLen != 0)	{
-			// buffer size is critical *don't change*
-			const size_t WRITE_BLOCK_CONST = 512;
-			uint8_t buf[WRITE_BLOCK_CONST];
-			long tStart = millis();
-			size_t numRemaining = contentLen;
-
 			// high speed raw write implementation
-			// close any previous file
-			nFile.close();
-			// delete old file
-			sd.remove(uri.c_str());
+			// the old file stays in place until the new one is complete
+			if(!prepareUploadTemp())
+				return;
 
 			// create a contiguous file
 			size_t contBlocks = (contentLen/WRITE_BLOCK_CONST + 1);
 			uint32_t bgnBlock, endBlock;
 
-			if (!nFile.createContiguous(sd.vwd(), uri.c_str(), contBlocks * WRITE_BLOCK_CONST))
-				return handleWriteError("File create contiguous sections failed", &nFile);
+			if (!createUpload(nFile, conn->_tempPath, contBlocks))
+				return handleWriteError("No contiguous space for the file", &nFile, "507 Insufficient Storage");
 
 			// get the location of the file's blocks
 			if (!nFile.contiguousRange(&bgnBlock, &endBlock))
 				return handleWriteError("Unable to get contiguous range", &nFile);
 
-			if (!sd.card()->writeStart(bgnBlock, contBlocks))
-				return handleWriteError("Unable to start writing contiguous range", &nFile);
-
-			// read data from stream and write to the file
-			while(numRemaining > 0)	{
-				size_t numToRead = (numRemaining > WRITE_BLOCK_CONST) ? WRITE_BLOCK_CONST : numRemaining;
-				size_t numRead = readBytesWithTimeout(buf, sizeof(buf), numToRead);
-				if(numRead == 0)
-					break;
-
-				// store whole buffer into file regardless of numRead
-				if (!sd.card()->writeData(buf))
-					return handleWriteError("Write data failed", &nFile);
-
-				// reduce the number outstanding
-				numRemaining -= numRead;
+			// erasing ahead moves the erase cost out of the write path, but blocks the server meanwhile
+			if(DAV_UPLOAD_STRATEGY == DAV_UPLOAD_PREERASED)	{
+				unsigned long eraseStart = millis();
+				if(!sd.card()->erase(bgnBlock, endBlock))
+					DBG_PRINTLN("Pre-erase refused, writing anyway");
+				DBG_PRINT("Pre-erase: "); DBG_PRINT(millis() - eraseStart); DBG_PRINTLN(" ms");
 			}
 
-			// stop writing operation
-			if (!sd.card()->writeStop())
-				return handleWriteError("Unable to stop writing contiguous range", &nFile);
-
-			// detect timeout condition
-			if(numRemaining)
-				return handleWriteError("Timed out waiting for data", &nFile);
-
-			// truncate the file to right length
-			if(!nFile.truncate(contentLen))
-				return handleWriteError("Unable to truncate the file", &nFile);
-
-			DBG_PRINT("File "); DBG_PRINT(contentLen - numRemaining); DBG_PRINT(" bytes stored in: "); DBG_PRINT((millis() - tStart)/1000); DBG_PRINTLN(" sec");
+			// the data is read from the stream over the next passes
+			conn->_rawWrite = true;
+			conn->_nextBlock = bgnBlock;
+			conn->_blockCount = contBlocks;
+			claimTransferBuffers();
+			conn->_ringStart = conn->_ringFill = 0;
+			return startStream(&ESPWebDAV::receiveFileSlice);
 		}
 	}
 	else
 	{
     // reopen file so we can seek within it
     nFile.close();
-    nFile.open(uri.c_str(), O_RDWR);
-
-		// set up buffer
-		const size_t WRITE_BLOCK_CONST = 512;
-		uint8_t buf[WRITE_BLOCK_CONST];
-		long tStart = millis();
-		size_t numRemaining = contentLen;
+    nFile.open(conn->uri, O_RDWR);
+		conn->_inPlaceSize = nFile.fileSize();
 
 		// seek to beginning of range
-    nFile.seekSet(_contentRangeStart);
-
-		// update file
-		while (numRemaining>0)
-		{
-			size_t numToRead = (numRemaining > WRITE_BLOCK_CONST) ? WRITE_BLOCK_CONST : numRemaining;
-			size_t numRead = readBytesWithTimeout(buf, sizeof(buf), numToRead);
-			if(numRead == 0)
-				break;
-			nFile.write(buf, numRead);
-			numRemaining-=numRead;
+    nFile.seekSet(conn->_contentRangeStart);
+
+		// update file over the next passes
+		conn->_rawWrite = false;
+		if(contentLen != 0)	{
+			claimTransferBuffers();
+			conn->_ringStart = conn->_ringFill = 0;
+			return startStream(&ESPWebDAV::receiveFileSlice);
 		}
 
 		// close
 		if (!nFile.close())
 			return handleWriteError("Unable to close file after write", &nFile);
+	}
+
+	finishPut();
+}
+
 
-		// timed out?
-		if (numRemaining)
-			return handleWriteError("Timed out waiting for data", &nFile);
 
-		DBG_PRINT("File "); DBG_PRINT(contentLen - numRemaining); DBG_PRINT(" bytes stored in: "); DBG_PRINT((millis() - tStart)/1000); DBG_PRINTLN(" sec");
+// ------------------------
+bool ESPWebDAV::createUpload(FatFile &nFile, const char *path, size_t contBlocks)	{
+// ------------------------
+	// uploads of at least one allocation unit start on its boundary, so the card
+	// does not have to merge a partly written unit while they are being written
+	bool aligned = false;
+	if(DAV_UPLOAD_STRATEGY != DAV_UPLOAD_PLAIN && _eraseBlocks && contBlocks >= _eraseBlocks)
+		aligned = sd.vol()->setContiguousAlignment(_eraseBlocks);
+
+	bool created = nFile.createContiguous(sd.vwd(), path, contBlocks * WRITE_BLOCK_CONST);
+	sd.vol()->setContiguousAlignment(0);
+
+	// no aligned run is free, any run will do
+	if(!created && aligned)	{
+		DBG_PRINTLN("No aligned space, allocating unaligned");
+		aligned = false;
+		created = nFile.createContiguous(sd.vwd(), path, contBlocks * WRITE_BLOCK_CONST);
 	}
 
-	if(resource == RESOURCE_NONE)
+	DBG_PRINT("Upload of "); DBG_PRINT(contBlocks); DBG_PRINTLN(aligned ? " blocks, aligned" : " blocks");
+
+	// Marlin skips hidden entries, a partial upload never shows up in its file list
+	if(!created || !nFile.setHidden(true))
+		return false;
+
+	// the extent is written around the volume cache, blocks of a deleted file it may still hold are stale
+	uint32_t bgnBlock, endBlock;
+	if(nFile.contiguousRange(&bgnBlock, &endBlock))
+		sd.vol()->invalidateBlocks(bgnBlock, endBlock - bgnBlock + 1);
+	return true;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::prepareUploadTemp()	{
+// ------------------------
+	// the response is sent here when the upload cannot start
+	if(!makeTempPath(conn->_tempPath, sizeof(conn->_tempPath), conn->uri))	{
+		send("414 URI Too Long", NULL, "");
+		return false;
+	}
+
+	// another connection still writing the same temp file keeps it
+	if(!claimTempPath(conn->_tempPath))	{
+		conn->_tempPath[0] = 0;
+		send("423 Locked", "text/plain", "The file is being uploaded by another connection");
+		return false;
+	}
+
+	// left behind by an upload that never completed, a suspended resumable one starts over,
+	// one still receiving a range is left alone
+	int8_t slot = findUpload(conn->uri);
+	if(slot >= 0 && _uploads[slot].busy)	{
+		conn->_tempPath[0] = 0;
+		send("423 Locked", "text/plain", "Another range of the upload is being received");
+		return false;
+	}
+	if(slot >= 0)
+		_uploads[slot].path[0] = 0;
+	sd.remove(conn->_tempPath);
+	return true;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::holdsTempPath(DAVConnection *c, const char *path)	{
+// ------------------------
+	// the temp file of the upload on connection c, or the ~ copy it is being relocated to
+	if(!c->_tempPath[0])
+		return false;
+	if(!strcmp(c->_tempPath, path))
+		return true;
+	size_t len = strlen(c->_tempPath);
+	return c->_relocFile.isOpen() && !strncmp(c->_tempPath, path, len) && !strcmp(path + len, "~");
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::claimTempPath(const char *path)	{
+// ------------------------
+	// a file another connection has open must not be removed under it, its directory
+	// entry and clusters would be freed a second time when that connection ends.
+	// a connection whose client is gone is dropped, its file closed and left in place
+	bool claimed = true;
+	for(uint8_t i = 0; i < DAV_MAX_CLIENTS; i++)	{
+		DAVConnection *c = &_conns[i];
+		if(c == conn || !holdsTempPath(c, path))
+			continue;
+		if(c->client.connected())	{
+			claimed = false;
+			continue;
+		}
+		DBG_PRINTLN("Dropping stale upload connection");
+		if(c->_uploadSlot < 0)	{
+			c->file.close();
+			c->_tempPath[0] = 0;
+		}
+		closeClient(c);
+	}
+	return claimed;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::makeTempPath(char *buf, size_t size, const char *path)	{
+// ------------------------
+	// same directory as the target, name prefixed so that it stays out of listings
+	const char *name = strrchr(path, '/');
+	int dirLen = name ? name - path + 1 : 0;
+	if(snprintf(buf, size, "%.*s" DAV_TEMP_PREFIX "%s", dirLen, path, path + dirLen) >= (int) size - 2)	{
+		buf[0] = 0;
+		return false;
+	}
+	return true;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::startResumablePut(SdFile &nFile)	{
+// ------------------------
+	uint32_t first = conn->_contentRangeStart;
+	uint32_t last = conn->_contentRangeEnd;
+	uint32_t total = conn->_contentRangeTotal;
+	if(last < first || last >= total || conn->_requestLength != last - first + 1)
+		return send("400 Bad Request", "text/plain", "Content-Range does not match the body");
+
+	int8_t slot = findUpload(conn->uri);
+	if(slot >= 0 && _uploads[slot].busy)
+		return send("423 Locked", "text/plain", "Another range of the upload is being received");
+
+	// a range starting inside a block is completed from the stored head of that block
+	claimTransferBuffers();
+	if(!conn->_xferBuf[0])	{
+		sendHeader("Retry-After", "1");
+		return send("503 Service Unavailable", NULL, "");
+	}
+
+	size_t contBlocks = (total/WRITE_BLOCK_CONST + 1);
+	uint32_t bgnBlock, endBlock;
+	if(!first)	{
+		// the first range starts the upload over, with the whole length preallocated
+		if(!prepareUploadTemp())
+			return;
+		if(!createUpload(nFile, conn->_tempPath, contBlocks))
+			return handleWriteError("No contiguous space for the file", &nFile, "507 Insufficient Storage");
+		slot = claimUpload(total);
+		if(slot < 0)	{
+			sendHeader("Retry-After", "1");
+			return handleWriteError("Too many resumable uploads", &nFile, "503 Service Unavailable");
+		}
+	}
+	else if(slot < 0 || _uploads[slot].total != total || first > _uploads[slot].committed)	{
+		// nothing to continue from, the client learns where to resume
+		if(slot >= 0)
+			sendUploadOffset(slot);
+		return send("409 Conflict", "text/plain", "Range does not continue the upload");
+	}
+	else if(!makeTempPath(conn->_tempPath, sizeof(conn->_tempPath), conn->uri) || !nFile.open(conn->_tempPath, O_RDWR))	{
+		// removed behind our back
+		_uploads[slot].path[0] = 0;
+		conn->_tempPath[0] = 0;
+		return send("409 Conflict", "text/plain", "Upload no longer exists");
+	}
+
+	// the temp file has to be the same single extent the earlier ranges went to
+	if(!nFile.contiguousRange(&bgnBlock, &endBlock) || endBlock - bgnBlock + 1 < contBlocks
+		|| (first && bgnBlock != _uploads[slot].firstBlock))	{
+		_uploads[slot].path[0] = 0;
+		return handleWriteError("Unable to get contiguous range", &nFile);
+	}
+
+	uint32_t startBlock = first / WRITE_BLOCK_CONST;
+	conn->_ringStart = 0;
+	conn->_ringFill = first % WRITE_BLOCK_CONST;
+	if(conn->_ringFill && !sd.card()->readBlock(bgnBlock + startBlock, conn->_xferBuf[0]))	{
+		_uploads[slot].path[0] = 0;
+		return handleWriteError("Unable to read the partial block", &nFile);
+	}
+
+	DBG_PRINT("Resumable range at "); DBG_PRINT(first); DBG_PRINT(" of "); DBG_PRINTLN(total);
+	_uploads[slot].firstBlock = bgnBlock;
+	_uploads[slot].busy = true;
+	conn->_uploadSlot = slot;
+	conn->_rawWrite = true;
+	conn->_nextBlock = bgnBlock + startBlock;
+	conn->_blockCount = contBlocks - startBlock;
+	startStream(&ESPWebDAV::receiveFileSlice);
+}
+
+
+
+// ------------------------
+int8_t ESPWebDAV::findUpload(const char *path)	{
+// ------------------------
+	for(uint8_t i = 0; i < DAV_RESUME_SLOTS; i++)
+		if(_uploads[i].path[0] && !strcmp(_uploads[i].path, path))
+			return i;
+	return -1;
+}
+
+
+
+// ------------------------
+int8_t ESPWebDAV::claimUpload(uint32_t total)	{
+// ------------------------
+	// a free slot, or else the least recently used one no range is being received for
+	int8_t found = -1;
+	for(uint8_t i = 0; i < DAV_RESUME_SLOTS; i++)	{
+		DAVUpload &up = _uploads[i];
+		if(up.busy)
+			continue;
+		if(found < 0 || !up.path[0] || (_uploads[found].path[0] && up.lastUsed < _uploads[found].lastUsed))
+			found = i;
+		if(!up.path[0])
+			break;
+	}
+	if(found < 0)
+		return -1;
+
+	// an abandoned upload gives way, its temp file goes with it
+	DAVUpload &up = _uploads[found];
+	char stale[DAV_MAX_PATH + 4];
+	if(up.path[0] && makeTempPath(stale, sizeof(stale), up.path))	{
+		DBG_PRINT("Dropping resumable upload "); DBG_PRINTLN(up.path);
+		sd.remove(stale);
+	}
+
+	strcpy(up.path, conn->uri);
+	up.total = total;
+	up.committed = 0;
+	up.lastUsed = millis();
+	return found;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::finishUploadRange()	{
+// ------------------------
+	int8_t slot = conn->_uploadSlot;
+	DAVUpload &up = _uploads[slot];
+	conn->_uploadSlot = -1;
+	up.busy = false;
+	up.lastUsed = millis();
+	if((uint32_t) conn->_contentRangeEnd + 1 > up.committed)
+		up.committed = conn->_contentRangeEnd + 1;
+
+	if(up.committed < up.total)	{
+		// more ranges to come, the temp file keeps its preallocated length
+		conn->file.close();
+		conn->_tempPath[0] = 0;
+		sendUploadOffset(slot);
+		send("204 No Content", NULL, "");
+		return false;
+	}
+
+	// the last range, the file is committed like a whole upload
+	up.path[0] = 0;
+	conn->_recvLength = up.total;
+	return true;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::suspendUpload(DAVConnection *c)	{
+// ------------------------
+	// whole blocks stored so far are kept, the client resumes after the last of them
+	int8_t slot = c->_uploadSlot;
+	DAVUpload &up = _uploads[slot];
+	uint32_t stored = (c->_nextBlock - up.firstBlock) * WRITE_BLOCK_CONST;
+	if(stored > up.total)
+		stored = up.total;
+	if(stored > up.committed)
+		up.committed = stored;
+	up.busy = false;
+	up.lastUsed = millis();
+
+	DBG_PRINT("Upload suspended at "); DBG_PRINTLN(up.committed);
+	c->_uploadSlot = -1;
+	c->file.close();
+	c->_tempPath[0] = 0;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::sendUploadOffset(int8_t slot)	{
+// ------------------------
+	sendHeader("Upload-Offset", String(_uploads[slot].committed));
+	sendHeader("Upload-Length", String(_uploads[slot].total));
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::commitUpload(FatFile *data)	{
+// ------------------------
+	// an existing target keeps its directory entry and takes over the new clusters,
+	// there is no moment without a complete file under its name
+	FatFile target;
+	if(target.open(sd.vwd(), conn->uri, O_RDWR))	{
+		bool replaced = data->replace(&target);
+		target.close();
+		if(!replaced)
+			return false;
+	}
+	// a new file is revealed under its name
+	else if(!data->setHidden(false) || !data->rename(sd.vwd(), conn->uri))
+		return false;
+
+	conn->_tempPath[0] = 0;
+	return true;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::startChunkedPut(SdFile &nFile)	{
+// ------------------------
+	// chunks are decoded straight into the ring, the stack block cannot hold them
+	claimTransferBuffers();
+	if(!conn->_xferBuf[0])	{
+		nFile.close();
+		sendHeader("Retry-After", "1");
+		return send("503 Service Unavailable", NULL, "");
+	}
+	conn->_ringStart = conn->_ringFill = 0;
+	conn->_recvLength = 0;
+
+	if(!prepareUploadTemp())
+		return;
+
+	// the announced length is preallocated like a plain upload, a longer body
+	// carries on past the extent through FatFile
+	if(conn->_expectedLength)	{
+		size_t contBlocks = (conn->_expectedLength/WRITE_BLOCK_CONST + 1);
+		uint32_t bgnBlock, endBlock;
+		if(createUpload(nFile, conn->_tempPath, contBlocks) && nFile.contiguousRange(&bgnBlock, &endBlock))	{
+			conn->_rawWrite = true;
+			conn->_nextBlock = bgnBlock;
+			conn->_blockCount = contBlocks;
+			return startStream(&ESPWebDAV::receiveFileSlice);
+		}
+		// only the file this connection created goes, the name was claimed above
+		if(nFile.isOpen())
+			nFile.remove();
+	}
+
+	// otherwise the file grows a cluster at a time and is made contiguous once complete
+	if(!nFile.open(conn->_tempPath, O_RDWR | O_CREAT | O_TRUNC) || !nFile.setHidden(true))
+		return handleWriteError("Unable to create a new file", &nFile);
+	conn->_rawWrite = false;
+	startStream(&ESPWebDAV::receiveFileSlice);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::receiveFileSlice()	{
+// ------------------------
+	// the upload is set up, a client waiting for 100 Continue may send the body now
+	sendContinue();
+
+	SdFile &nFile = conn->file;
+	bool writing = false;
+	uint8_t written = 0;
+
+	// the pooled buffers form a ring of blocks, without them a single block on the stack
+	// is used and only filled once the whole block has arrived
+	uint8_t local[WRITE_BLOCK_CONST] __attribute__((aligned(4)));
+	bool pooled = (conn->_xferBuf[0] != NULL);
+	size_t segment = pooled ? DAV_XFER_BUFFER_SIZE : sizeof(local);
+	size_t ringSize = pooled ? (conn->_xferBuf[1] ? 2 : 1) * DAV_XFER_BUFFER_SIZE : sizeof(local);
+
+	for(;;)	{
+		bool progress = false;
+
+		// take whatever TCP has queued, up to the end of the free space or of the segment
+		size_t numAvailable = conn->client.available();
+		size_t head = (conn->_ringStart + conn->_ringFill) % ringSize;
+		size_t numToRead = ringSize - conn->_ringFill;
+		if(numToRead > segment - head % segment)
+			numToRead = segment - head % segment;
+		if(!conn->_chunkedBody && numToRead > conn->_recvRemaining)
+			numToRead = conn->_recvRemaining;
+		if(numToRead > numAvailable)
+			numToRead = pooled ? numAvailable : 0;
+
+		if(numToRead > 0)	{
+			uint8_t *dst = pooled ? conn->_xferBuf[head / segment] + head % segment : local + head;
+			size_t numRead;
+			if(conn->_chunkedBody)	{
+				// the framing takes part of what is available, count only the data
+				ChunkState before = conn->_chunkState;
+				numRead = readChunkedBody(dst, numToRead);
+				conn->_recvLength += numRead;
+				progress = (numRead > 0 || conn->_chunkState != before);
+			}
+			else	{
+				numRead = conn->client.read(dst, numToRead);
+				conn->_bodyRemaining -= (numRead < conn->_bodyRemaining) ? numRead : conn->_bodyRemaining;
+				// reduce the number outstanding
+				conn->_recvRemaining -= numRead;
+				progress = (numRead > 0);
+			}
+			conn->_ringFill += numRead;
+			conn->_lastActivity = millis();
+		}
+
+		if(conn->_chunkState == CHUNK_ERROR)	{
+			if(writing)
+				sd.card()->writeStop();
+			handleWriteError("Malformed chunked body", &nFile);
+			return true;
+		}
+
+		// store every complete block back to back, and the last partial one once the body is in
+		while(written < DAV_RECEIVE_SLICE && (conn->_ringFill >= WRITE_BLOCK_CONST || (conn->_ringFill && bodyReceived())))	{
+			size_t start = conn->_ringStart;
+			uint8_t *block = pooled ? conn->_xferBuf[start / segment] + start % segment : local;
+			size_t blockLen = (conn->_ringFill > WRITE_BLOCK_CONST) ? WRITE_BLOCK_CONST : conn->_ringFill;
+
+			if(conn->_rawWrite && !conn->_blockCount)	{
+				// a chunked body outgrew its preallocated extent, the rest is appended
+				if(writing && !sd.card()->writeStop())	{
+					handleWriteError("Unable to stop writing contiguous range", &nFile);
+					return true;
+				}
+				writing = false;
+				conn->_rawWrite = false;
+				nFile.seekEnd();
+			}
+
+			if(conn->_rawWrite)	{
+				// the card leaves multi block write mode before the pass ends,
+				// other connections may use it in between
+				if(!writing)	{
+					if (!sd.card()->writeStart(conn->_nextBlock, conn->_blockCount))	{
+						handleWriteError("Unable to start writing contiguous range", &nFile);
+						return true;
+					}
+					writing = true;
+				}
+				// store whole block into file regardless of its fill
+				if (!sd.card()->writeData(block))	{
+					// the card has to leave CMD25 before anyone else uses the bus
+					sd.card()->writeStop();
+					handleWriteError("Write data failed", &nFile);
+					return true;
+				}
+				conn->_nextBlock++;
+				conn->_blockCount--;
+			}
+			// nothing was preallocated for a chunked body, a full card shows up here
+			else if(nFile.write(block, blockLen) != (int) blockLen)	{
+				handleWriteError("Unable to write the file", &nFile, "507 Insufficient Storage");
+				return true;
+			}
+
+			conn->_ringStart = (start + WRITE_BLOCK_CONST) % ringSize;
+			conn->_ringFill -= blockLen;
+			written++;
+			progress = true;
+		}
+
+		if(!progress || written >= DAV_RECEIVE_SLICE)
+			break;
+	}
+
+	// stop writing operation
+	if (writing && !sd.card()->writeStop())	{
+		handleWriteError("Unable to stop writing contiguous range", &nFile);
+		return true;
+	}
+
+	if(!bodyReceived() || conn->_ringFill)	{
+		// detect timeout condition
+		if(!bodyReceived() && (!conn->client.connected() || millis() - conn->_lastActivity > HTTP_MAX_POST_WAIT))	{
+			handleWriteError("Timed out waiting for data", &nFile);
+			return true;
+		}
+		return false;
+	}
+
+	// a range of a resumable upload, only the last one completes the file
+	if(conn->_uploadSlot >= 0 && !finishUploadRange())
+		return true;
+
+	if(conn->_rawWrite)	{
+		// truncate the file to right length
+		if(!nFile.truncate(conn->_recvLength))	{
+			handleWriteError("Unable to truncate the file", &nFile);
+			return true;
+		}
+	}
+	// a chunked upload that grew cluster by cluster is copied into one extent
+	else if(conn->_chunkedBody && startRelocation())
+		return false;
+
+	// a whole upload replaces the target
+	if(conn->_tempPath[0])	{
+		if(!commitUpload(&nFile))	{
+			handleWriteError("Unable to replace the file", &nFile);
+			return true;
+		}
+	}
+	// close
+	else if (!nFile.close())	{
+		handleWriteError("Unable to close file after write", &nFile);
+		return true;
+	}
+
+	unsigned long elapsed = millis() - conn->_transferStart;
+	DBG_PRINT("File "); DBG_PRINT(conn->_recvLength); DBG_PRINT(" bytes stored in: "); DBG_PRINT(elapsed); DBG_PRINT(" ms, ");
+	DBG_PRINT(elapsed ? (float) conn->_recvLength / 1048.576 / elapsed : 0.0, 2); DBG_PRINTLN(" MB/s");
+	finishPut();
+	return true;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::startRelocation()	{
+// ------------------------
+	SdFile &nFile = conn->file;
+	uint32_t bgnBlock, endBlock;
+
+	// nothing to gain when the clusters happen to be consecutive already
+	if(!nFile.sync() || !nFile.fileSize() || nFile.contiguousRange(&bgnBlock, &endBlock))
+		return false;
+
+	// the copy is another hidden file, named after the upload with a trailing ~
+	size_t tempLen = strlen(conn->_tempPath);
+	strcpy(conn->_tempPath + tempLen, "~");
+	bool created = claimTempPath(conn->_tempPath);
+	if(created)	{
+		sd.remove(conn->_tempPath);
+		created = createUpload(conn->_relocFile, conn->_tempPath, nFile.fileSize()/WRITE_BLOCK_CONST + 1);
+	}
+	conn->_tempPath[tempLen] = 0;
+	if(!created)
+		return false;
+	if(!conn->_relocFile.contiguousRange(&bgnBlock, &endBlock))	{
+		conn->_relocFile.remove();
+		return false;
+	}
+
+	DBG_PRINT("Relocating fragmented upload to block "); DBG_PRINTLN(bgnBlock);
+	nFile.rewind();
+	conn->_nextBlock = bgnBlock;
+	conn->_recvRemaining = nFile.fileSize();
+	conn->_step = &ESPWebDAV::relocateSlice;
+	return true;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::relocateSlice()	{
+// ------------------------
+	SdFile &nFile = conn->file;
+	uint8_t *buf = conn->_xferBuf[0];
+
+	// whole buffers are read from the fragmented file and written as raw blocks
+	for(int i = 0; i < DAV_RECEIVE_SLICE / (DAV_XFER_BUFFER_SIZE / WRITE_BLOCK_CONST) && conn->_recvRemaining; i++)	{
+		int numRead = nFile.read(buf, DAV_XFER_BUFFER_SIZE);
+		size_t blocks = (numRead + WRITE_BLOCK_CONST - 1) / WRITE_BLOCK_CONST;
+		if(numRead <= 0 || !sd.card()->writeBlocks(conn->_nextBlock, buf, blocks))	{
+			DBG_PRINTLN("Relocation failed, keeping the fragmented file");
+			conn->_relocFile.remove();
+			conn->_relocFile.close();
+			break;
+		}
+		conn->_nextBlock += blocks;
+		conn->_recvRemaining -= ((size_t) numRead < conn->_recvRemaining) ? numRead : conn->_recvRemaining;
+	}
+	if(conn->_relocFile.isOpen() && conn->_recvRemaining)
+		return false;
+
+	// the copy replaces the target and the fragmented upload is dropped,
+	// without a copy the fragmented upload replaces it
+	if(conn->_relocFile.isOpen())	{
+		if(conn->_relocFile.truncate(conn->_recvLength) && commitUpload(&conn->_relocFile))
+			nFile.remove();
+		else
+			conn->_relocFile.remove();
+		conn->_relocFile.close();
+	}
+	if(conn->_tempPath[0] && !commitUpload(&nFile))	{
+		handleWriteError("Unable to replace the file", &nFile);
+		return true;
+	}
+
+	unsigned long elapsed = millis() - conn->_transferStart;
+	DBG_PRINT("File "); DBG_PRINT(conn->_recvLength); DBG_PRINT(" bytes stored and relocated in: "); DBG_PRINT(elapsed); DBG_PRINTLN(" ms");
+	finishPut();
+	return true;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::finishPut()	{
+// ------------------------
+	// size and stamp of the entry changed while the body was written
+	invalidateListCache();
+
+	if(conn->_resource == RESOURCE_NONE)
 		send("201 Created", NULL, "");
 	else
 		send("200 OK", NULL, "");
 
-	nFile.close();
+	conn->file.close();
 }
 
 
 
 
 // ------------------------
-void ESPWebDAV::handleWriteError(String message, FatFile *wFile)	{
+void ESPWebDAV::handleWriteError(String message, FatFile *wFile, const char *status)	{
 // ------------------------
-	// close this file
-	wFile->close();
-	// delete the wrile being written
-	sd.remove(uri.c_str());
+	// a resumable upload keeps what has been stored
+	if(conn->_uploadSlot >= 0)	{
+		int8_t slot = conn->_uploadSlot;
+		suspendUpload(conn);
+		sendUploadOffset(slot);
+		send(status, "text/plain", message);
+		DBG_PRINTLN(message);
+		return;
+	}
+
+	// a whole upload only ever wrote its temp file, a range updated an existing file
+	// in place and takes back what it appended, a new file goes altogether
+	if(conn->_tempPath[0] || conn->_resource == RESOURCE_NONE)	{
+		wFile->close();
+		sd.remove(conn->_tempPath[0] ? conn->_tempPath : conn->uri);
+	}
+	else	{
+		if(wFile->isOpen() && wFile->fileSize() > conn->_inPlaceSize)
+			wFile->truncate(conn->_inPlaceSize);
+		wFile->close();
+	}
+	conn->_tempPath[0] = 0;
+	invalidateListCache();
 	// send error
-	send("500 Internal Server Error", "text/plain", message);
+	send(status, "text/plain", message);
 	DBG_PRINTLN(message);
 }
 
@@ -564,14 +1719,14 @@ void ESPWebDAV::handleDirectoryCreate(ResourceType resource)	{
 		return handleNotFound();
 
 	// create directory
-	if (!sd.mkdir(uri.c_str(), true)) {
+	if (!sd.mkdir(conn->uri, true)) {
 		// send error
 		send("500 Internal Server Error", "text/plain", "Unable to create directory");
 		DBG_PRINTLN("Unable to create directory");
 		return;
 	}
 
-	DBG_PRINT(uri);	DBG_PRINTLN(" directory created");
+	DBG_PRINT(conn->uri);	DBG_PRINTLN(" directory created");
 	sendHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
 	send("201 Created", NULL, "");
 }
@@ -587,15 +1742,15 @@ void ESPWebDAV::handleMove(ResourceType resource)	{
 	if(resource == RESOURCE_NONE)
 		return handleNotFound();
 
-	if(destinationHeader.length() == 0)
+	if(!conn->destination[0])
 		return handleNotFound();
 
-	String dest = urlToUri(destinationHeader);
+	const char *dest = conn->destination;
 
 	DBG_PRINT("Move destination: "); DBG_PRINTLN(dest);
 
 	// move file or directory
-	if ( !sd.rename(uri.c_str(), dest.c_str())	) {
+	if ( !sd.rename(conn->uri, dest)	) {
 		// send error
 		send("500 Internal Server Error", "text/plain", "Unable to move");
 		DBG_PRINTLN("Unable to move file/directory");
@@ -623,10 +1778,10 @@ void ESPWebDAV::handleDelete(ResourceType resource)	{
 
 	if(resource == RESOURCE_FILE)
 		// delete a file
-		retVal = sd.remove(uri.c_str());
+		retVal = sd.remove(conn->uri);
 	else
 		// delete a directory
-		retVal = sd.rmdir(uri.c_str());
+		retVal = sd.rmdir(conn->uri);
 
 	if(!retVal)	{
 		// send error
@@ -17,8 +17,203 @@
 #define CONTENT_RANGE_NOT_SET ((size_t) -1)
 #define HTTP_MAX_POST_WAIT 		5000 
 
+// persistent connections, set HTTP_KEEPALIVE_MAX to 1 to close after every request
+#define HTTP_KEEPALIVE_TIMEOUT	2000	// ms an idle connection is kept open
+#define HTTP_KEEPALIVE_MAX		100		// requests served on one connection
+#define HTTP_KEEPALIVE_DRAIN	2048	// unread request body discarded to keep a connection
+
+// request head limits, every connection parses into fixed buffers of these sizes
+#define HTTP_MAX_LINE			384		// longest request or header line
+#define HTTP_MAX_HEADER_BYTES	2048	// whole request head, answered with 431 beyond this
+#define DAV_MAX_PATH			256		// decoded uri and destination
+#define HTTP_MAX_CONDITION		64		// If-None-Match list kept for revalidation
+
+// connection table, clients beyond this wait in the lwIP backlog
+#define DAV_MAX_CLIENTS			4
+#define DAV_SEND_SLICE			(4 * 1460)	// bytes of a GET body sent per pass
+#define DAV_SEND_SEGMENT		1460		// bytes handed to TCP per write
+#define DAV_RECEIVE_SLICE		16			// blocks of a PUT body stored per pass
+#define DAV_PROP_SLICE			4			// PROPFIND children listed per pass
+
+// transfer buffers, shared by the GET and PUT bodies in progress, each takes up to two
+// a GET refill is one multi-block read, across cluster boundaries only inside a run of consecutive clusters,
+// a PUT uses its buffers as one ring of blocks
+#define DAV_XFER_BUFFERS		2		// one download double buffered, others fall back to a block on the stack
+#define DAV_XFER_BUFFER_SIZE	(4 * 512)	// power of two
+#if DAV_XFER_BUFFER_SIZE % 512
+#error "DAV_XFER_BUFFER_SIZE must hold whole blocks, raw reads fill it a block at a time"
+#endif
+
+// where a contiguous upload is placed on the card
+#define DAV_UPLOAD_PLAIN		0		// first free run, as SdFat finds it
+#define DAV_UPLOAD_ALIGNED		1		// run starting on the card's allocation unit
+#define DAV_UPLOAD_PREERASED	2		// aligned, and erased before the data is written
+#define DAV_UPLOAD_STRATEGY		DAV_UPLOAD_PLAIN		// the others are opt-in until benchmarked on real cards
+#define DAV_TEMP_PREFIX			".~"	// hidden name a whole upload is written to before it replaces the target
+#define DAV_RESUME_SLOTS		2		// resumable uploads, PUT ranges with a known total, tracked at once
+
+// GET byte ranges, more than DAV_MAX_RANGES in one request are answered with the whole file
+#define DAV_MAX_RANGES			4
+#define DAV_RANGE_OPEN			((uint32_t) -1)		// "first-" has last open, "-suffix" has first open
+#define DAV_BYTERANGES_BOUNDARY	"ESPWebDAV_byteranges_3f9a1c"
+#define DAV_PART_HEADER			160
+
+// Depth: infinity PROPFIND, walked with a fixed stack of open directories
+#define DAV_PROPFIND_MAX_DEPTH		4		// directory levels below the request uri, each holds a FatFile per connection
+#define DAV_PROPFIND_MAX_ENTRIES	2000	// entries listed before the result is cut short with 507
+
+// Depth 1 listings kept in RAM, keyed by the first cluster of the directory
+#define DAV_LIST_CACHE_SLOTS	1
+#define DAV_LIST_CACHE_BYTES	2048	// per slot, larger listings are not cached
+
+// first block of recently sent files, keyed by first cluster, so a GET skips the FAT walk
+#define DAV_RAW_CACHE_SLOTS		4
+
+// free space reported as PROPFIND quota, loaded from FSINFO and confirmed by a FAT count while idle
+#define DAV_FREE_SCAN_BLOCKS	16		// FAT blocks counted each time the bus is taken for it
+#define DAV_FSINFO_INTERVAL		30000	// ms between FSINFO writes of a changed count, not one per file
+
+// response writer, output is collected and sent one TCP segment at a time
+#define DAV_OUT_BUFFER			1460		// one MSS
+#define DAV_OUT_RESERVE			12			// room for chunk header "5a8\r\n" and trailer "\r\n0\r\n\r\n"
+
 enum ResourceType { RESOURCE_NONE, RESOURCE_FILE, RESOURCE_DIR };
 enum DepthType { DEPTH_NONE, DEPTH_CHILD, DEPTH_ALL };
+enum ConnState { CONN_IDLE, CONN_HEADERS, CONN_BODY, CONN_STREAM };
+enum ChunkState { CHUNK_START, CHUNK_SIZE, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNK_TRAILER_LINE, CHUNK_DONE, CHUNK_ERROR };
+// order matches ESPWebDAV::methodTable
+enum MethodType { METHOD_UNKNOWN, METHOD_PROPFIND, METHOD_GET, METHOD_HEAD, METHOD_OPTIONS, METHOD_PUT,
+	METHOD_LOCK, METHOD_UNLOCK, METHOD_PROPPATCH, METHOD_MKCOL, METHOD_MOVE, METHOD_DELETE, METHOD_COUNT };
+
+// what PROPFIND reports of one entry, followed by its NUL terminated name in a cached listing
+struct DAVListRecord	{
+	uint32_t	cluster;
+	uint32_t	size;
+	uint16_t	date;
+	uint16_t	time;
+	bool		isDir;
+	uint8_t		nameLen;
+};
+
+// one cached directory listing, slots in use by a connection are never reused
+struct DAVListing	{
+	uint32_t	cluster;
+	uint32_t	lastUsed;
+	uint16_t	length;
+	uint8_t		users;
+	bool		valid;
+	uint8_t		data[DAV_LIST_CACHE_BYTES];
+};
+
+// a resumable upload, its temp file is preallocated to the total length
+struct DAVUpload	{
+	char		path[DAV_MAX_PATH];		// target, empty for a free slot
+	uint32_t	total;
+	uint32_t	committed;				// bytes from the start known to be stored
+	uint32_t	firstBlock;
+	uint32_t	lastUsed;
+	bool		busy;					// a range is being received
+};
+
+// where a file lies on the card, dropped with the listing cache
+struct DAVRawEntry	{
+	uint32_t	cluster;				// first cluster, 0 for a free slot
+	uint32_t	firstBlock;				// 0 if the file is fragmented
+};
+
+// one requested byte range, inclusive
+struct DAVRange	{
+	uint32_t	first;
+	uint32_t	last;
+};
+
+class ESPWebDAV;
+// resumable part of a handler, returns true once the response is complete
+typedef bool (ESPWebDAV::*TStepFunction)();
+
+// state of one client connection, kept between loop() passes
+struct DAVConnection	{
+	WiFiClient 	client;
+	ConnState	_state;
+
+	// request being serviced, tokenized in place without heap allocation
+	char		_line[HTTP_MAX_LINE];
+	uint16_t	_lineLen;
+	uint16_t	_headerBytes;
+	bool		_haveRequestLine;
+	MethodType	method;
+	char		uri[DAV_MAX_PATH];
+	// only MOVE reads the destination and only PROPFIND walks, one buffer serves both
+	union	{
+		char	destination[DAV_MAX_PATH];
+		char	_propPath[DAV_MAX_PATH];	// entry being listed by a Depth: infinity walk
+	};
+	size_t		_requestLength;
+	DepthType	depth;
+	bool		_connClose, _connKeepAlive;
+	bool		_expectContinue;		// 100 Continue is owed before the body is read
+	bool		_http10;
+	size_t		_bodyRemaining;
+	bool		_chunkedBody;			// Transfer-Encoding: chunked, _bodyRemaining is unused
+	ChunkState	_chunkState;
+	uint32_t	_chunkRemaining;
+	size_t		_expectedLength;		// X-Expected-Entity-Length of a chunked PUT, 0 if absent
+	DAVRange	_ranges[DAV_MAX_RANGES];
+	uint8_t		_rangeCount;
+	char		_ifNoneMatch[HTTP_MAX_CONDITION];
+	uint32_t	_ifModifiedSince;		// FAT date << 16 | FAT time, 0 if absent
+
+	// response
+	String 		_responseHeaders;
+	bool		_chunked;
+	int			_contentLength, _contentRangeStart, _contentRangeEnd, _contentRangeTotal;
+
+	// body still to be streamed, in or out
+	TStepFunction	_step;
+	SdFile		file;
+	size_t		_sendRemaining;		// bytes still to be read from the file
+	size_t		_sendLength;
+	uint8_t		*_xferBuf[2];		// pooled transfer buffers, NULL if none was free
+	uint16_t	_sendBufLen[2];
+	uint16_t	_sendBufPos;		// in the buffer being sent
+	uint8_t		_sendCur;
+	uint8_t		_rangeIndex;		// range being sent
+	bool		_multipart;
+	uint32_t	_rawFirst;			// first block of a contiguous file, 0 if fragmented
+	FatExtentMap	_extentMap;			// cluster runs of a fragmented file being sent
+	uint32_t	_rawBlock;			// next block of a contiguous file read past FatFile, 0 if not
+	uint16_t	_rawSkip;			// bytes of the first raw block before the range
+	bool		_rawOpen;			// CMD18 in progress, stopped before the pass ends
+	uint16_t	_ringStart;			// PUT ring, offset of the oldest byte not yet stored
+	uint16_t	_ringFill;
+	int8_t		_uploadSlot;			// resumable upload this PUT range belongs to, -1 if none
+	FatFile		_relocFile;			// contiguous copy of an upload that grew fragmented
+	char		_tempPath[DAV_MAX_PATH + 4];	// hidden file a whole upload goes to, empty for updates in place
+	size_t		_recvRemaining;
+	size_t		_recvLength;
+
+	// PROPFIND walk, conn->file is the request uri and the stack holds the levels below it
+	FatFile		_propStack[DAV_PROPFIND_MAX_DEPTH];
+	uint16_t	_propPathLen[DAV_PROPFIND_MAX_DEPTH];
+	uint8_t		_propDepth;
+	uint16_t	_propEntries;
+	bool		_propTruncated;
+	int8_t		_listSlot;			// listing cache slot recorded or replayed, -1 if none
+	bool		_listReplay;
+	uint16_t	_listPos;
+	uint16_t	_listGeneration;
+	uint32_t	_nextBlock;
+	uint32_t	_blockCount;
+	bool		_rawWrite;
+	ResourceType	_resource;
+	uint32_t	_inPlaceSize;		// size of a file updated in place, cut back to it if the update fails
+	unsigned long	_transferStart;
+
+	// persistent connection state
+	bool		_keepAlive;
+	uint16_t	_requestCount;
+	unsigned long	_lastActivity;
+};
 
 
 class ESPWebDAV	{
@@ -27,13 +222,52 @@ public:
   bool initSD(int chipSelectPin, SPISettings spiSettings);
   bool startServer();
 	bool isClientWaiting();
+	bool isBusy();
+	bool hasClients();
+	void abortClients();
 	void handleClient(String blank = "");
 	void rejectClient(String rejectMessage);
+	void invalidateListCache();
+	void invalidateBlockCache();
+	bool flushBlockCache();
+	bool wantsFreeCount();
+	bool countFreeSpace();
 
 protected:
 	typedef void (ESPWebDAV::*THandlerFunction)(String);
+	typedef void (ESPWebDAV::*THeaderFunction)(char *value);
+	struct THeaderEntry { const char *name; THeaderFunction parse; };
+	static const THeaderEntry headerTable[];
+	typedef void (ESPWebDAV::*TResourceFunction)(ResourceType resource);
+	struct TMethodEntry { const char *name; TResourceFunction handler; bool needsResource; bool modifiesListing; };
+	struct TMimeEntry { const char *ext; const char *type; };
+	static const TMimeEntry mimeTable[];
 
 	void processClient(THandlerFunction handler, String message);
+	void stepClient(THandlerFunction handler, String message);
+	void acceptClients();
+	void beginRequest();
+	void dispatchRequest(THandlerFunction handler, String message);
+	void startStream(TStepFunction step);
+	void finishRequest();
+	bool sendFileSlice();
+	int fillSendBuffer(uint8_t *buf, size_t bufSize);
+	int fillRawBuffer(uint8_t *buf, size_t bufSize);
+	void stopRawRead(DAVConnection *c);
+	void claimTransferBuffers();
+	void releaseTransferBuffers(DAVConnection *c);
+	bool sendPropSlice();
+	bool sendCachedPropSlice();
+	void closePropWalk(DAVConnection *c);
+	void finishPropWalk();
+	uint32_t rawFirstBlock(FatFile &file);
+	bool findListing(uint32_t cluster);
+	void claimListing(uint32_t cluster);
+	void recordListing(const DAVListRecord *rec, const char *name);
+	void commitListing();
+	void releaseListing(DAVConnection *c);
+	bool receiveFileSlice();
+	void finishPut();
 	void handleNotFound();
 	void handleReject(String rejectMessage);
 	void handleRequest(String blank);
@@ -42,45 +276,124 @@ protected:
 	void handleUnlock(ResourceType resource);
 	void handlePropPatch(ResourceType resource);
 	void handleProp(ResourceType resource);
-	void sendPropResponse(boolean recursing, FatFile *curFile);
+	void readPropRecord(FatFile *curFile, DAVListRecord *rec, char *name, size_t nameSize);
+	void sendPropResponse(boolean recursing, const DAVListRecord *rec, const char *name);
+	void sendQuotaProps();
+	void formatHttpDate(char *buf, uint16_t fatDate, uint16_t fatTime);
+	void formatETag(char *buf, uint32_t cluster, uint32_t size, uint16_t fatDate, uint16_t fatTime);
+	void formatBytes(char *buf, uint64_t bytes);
 	void handleGet(ResourceType resource, bool isGet);
+	bool resolveRanges(size_t fileSize);
+	void startRange();
+	size_t formatPartHeader(char *buf, uint8_t index, const char *contentType, size_t fileSize);
+	void handleGet(ResourceType resource);
+	void handleHead(ResourceType resource);
   void handlePut(ResourceType resource);
-	void handleWriteError(String message, FatFile *wFile);
+	bool createUpload(FatFile &nFile, const char *path, size_t contBlocks);
+	bool prepareUploadTemp();
+	bool makeTempPath(char *buf, size_t size, const char *path);
+	bool holdsTempPath(DAVConnection *c, const char *path);
+	bool claimTempPath(const char *path);
+	void startResumablePut(SdFile &nFile);
+	int8_t findUpload(const char *path);
+	int8_t claimUpload(uint32_t total);
+	bool finishUploadRange();
+	void suspendUpload(DAVConnection *c);
+	void sendUploadOffset(int8_t slot);
+	bool commitUpload(FatFile *data);
+	void startChunkedPut(SdFile &nFile);
+	bool startRelocation();
+	bool relocateSlice();
+	uint32_t readEraseSize();
+	void handleWriteError(String message, FatFile *wFile, const char *status = "500 Internal Server Error");
 	void handleDirectoryCreate(ResourceType resource);
 	void handleMove(ResourceType resource);
 	void handleDelete(ResourceType resource);
 
 	// Sections are copied from ESP8266Webserver
-	String getMimeType(String path);
-	String urlDecode(const String& text);
-	String urlToUri(String url);
-	bool parseRequest();
+	const char *getMimeType(const char *path);
+	bool urlDecode(char *decoded, const char *text, size_t size);
+	const char *urlToUri(const char *url);
+	bool readRequestHead();
+	void rejectRequestHead(const char *code);
+	bool parseRequestLine(char *req);
+	void parseHeaderLine(char *req);
+	void parseDepthHeader(char *value);
+	void parseLengthHeader(char *value);
+	void parseDestinationHeader(char *value);
+	void parseConnectionHeader(char *value);
+	void parseRangeHeader(char *value);
+	void parseContentRangeHeader(char *value);
+	void parseTransferEncodingHeader(char *value);
+	void parseExpectHeader(char *value);
+	void parseExpectedLengthHeader(char *value);
+	void parseIfNoneMatchHeader(char *value);
+	void parseIfModifiedSinceHeader(char *value);
+	bool isNotModified(const dir_t *dir, const char *etag);
 	void sendHeader(const String& name, const String& value, bool first = false);
 	void send(String code, const char* content_type, const String& content);
 	void _prepareHeader(String& response, String code, const char* content_type, size_t contentLength);
 	void sendContent(const String& content);
+	void sendContent(const __FlashStringHelper *content);
+	void sendContent(const char *content);
 	void sendContent_P(PGM_P content);
+	void bufferOutput(const char *data, size_t len, bool progmem, bool raw);
+	void flushOutput(bool last);
 	void setContentLength(size_t len);
-	size_t readBytesWithTimeout(uint8_t *buf, size_t bufSize);
-	size_t readBytesWithTimeout(uint8_t *buf, size_t bufSize, size_t numToRead);
+	size_t readRequestBody(uint8_t *buf, size_t bufSize);
+	bool drainRequestBody();
+	size_t readChunkedBody(uint8_t *buf, size_t bufSize);
+	bool bodyReceived();
+	void sendContinue();
+	void closeClient(DAVConnection *c);
+
+	// request methods, indexed by MethodType, after the handlers it points to
+	// OPTIONS and UNLOCK answer without looking at the card
+	static constexpr TMethodEntry methodTable[METHOD_COUNT] = {
+		// name			handler									needs resource type	changes listings
+		{ "UNKNOWN",	NULL,									false,	false },
+		{ "PROPFIND",	&ESPWebDAV::handleProp,					true,	false },
+		{ "GET",		&ESPWebDAV::handleGet,					true,	false },
+		{ "HEAD",		&ESPWebDAV::handleHead,					true,	false },
+		{ "OPTIONS",	&ESPWebDAV::handleOptions,				false,	false },
+		{ "PUT",		&ESPWebDAV::handlePut,					true,	true },
+		{ "LOCK",		&ESPWebDAV::handleLock,					true,	false },
+		{ "UNLOCK",		&ESPWebDAV::handleUnlock,				false,	false },
+		{ "PROPPATCH",	&ESPWebDAV::handlePropPatch,			true,	false },
+		{ "MKCOL",		&ESPWebDAV::handleDirectoryCreate,		true,	true },
+		{ "MOVE",		&ESPWebDAV::handleMove,					true,	true },
+		{ "DELETE",		&ESPWebDAV::handleDelete,				true,	true },
+	};
 
 
-	// variables pertaining to current most HTTP request being serviced
 	WiFiServer *server;
 	SdFat sd;
+	uint32_t	_eraseBlocks;		// allocation unit of the card in blocks, 0 if unknown
+	unsigned long	_fsInfoWritten;		// millis() of the last FSINFO write
 
-	WiFiClient 	client;
-	String 		method;
-	String 		uri;
-	String 		contentLengthHeader;
-  String    contentRangeHeader;
-	String 		depthHeader;
-	String 		hostHeader;
-	String		destinationHeader;
+	// connection table and the connection currently being serviced
+	DAVConnection	_conns[DAV_MAX_CLIENTS];
+	DAVConnection	*conn;
+	uint8_t		_nextConn;
 
-	String 		_responseHeaders;
-	bool		_chunked;
-	int			_contentLength, _contentRangeStart, _contentRangeEnd;
+	// output of the connection being serviced, flushed before moving to the next one
+	// the leading _outRaw bytes are response head and never get chunk framing
+	char		_outBuf[DAV_OUT_BUFFER];
+	uint16_t	_outLen;
+	uint16_t	_outRaw;
+
+	// block aligned transfer buffers and the connection each one is lent to
+	uint8_t		_xferBuffers[DAV_XFER_BUFFERS][DAV_XFER_BUFFER_SIZE] __attribute__((aligned(4)));
+	DAVConnection	*_xferBufferOwner[DAV_XFER_BUFFERS];
+
+	// directory listing cache, shared by all connections
+	DAVListing	_listings[DAV_LIST_CACHE_SLOTS];
+	uint16_t	_listGeneration;
+	DAVRawEntry	_rawFiles[DAV_RAW_CACHE_SLOTS];
+	uint8_t		_nextRawFile;
+
+	// resumable uploads, they outlive the connections sending their ranges
+	DAVUpload	_uploads[DAV_RESUME_SLOTS];
 };
 
 extern ESPWebDAV dav;
@@ -1,52 +1,65 @@
 #include "ESPWebDAV.h"
 
+extern const char *months[];
+
 // Sections are copied from ESP8266Webserver
 
+// file extensions with a known mime type, matched without regard to case
+// as 8.3 names come back in upper case
+const ESPWebDAV::TMimeEntry ESPWebDAV::mimeTable[] = {
+	{ "html",		"text/html" },
+	{ "htm",		"text/html" },
+	{ "css",		"text/css" },
+	{ "txt",		"text/plain" },
+	{ "js",			"application/javascript" },
+	{ "json",		"application/json" },
+	{ "png",		"image/png" },
+	{ "gif",		"image/gif" },
+	{ "jpg",		"image/jpeg" },
+	{ "ico",		"image/x-icon" },
+	{ "svg",		"image/svg+xml" },
+	{ "ttf",		"application/x-font-ttf" },
+	{ "otf",		"application/x-font-opentype" },
+	{ "woff",		"application/font-woff" },
+	{ "woff2",		"application/font-woff2" },
+	{ "eot",		"application/vnd.ms-fontobject" },
+	{ "sfnt",		"application/font-sfnt" },
+	{ "xml",		"text/xml" },
+	{ "pdf",		"application/pdf" },
+	{ "zip",		"application/zip" },
+	{ "gz",			"application/x-gzip" },
+	{ "appcache",	"text/cache-manifest" },
+	{ NULL,			NULL }
+};
+
+
+
+// ------------------------
+const char *ESPWebDAV::getMimeType(const char *path) {
 // ------------------------
-String ESPWebDAV::getMimeType(String path) {
-// ------------------------
-	if(path.endsWith(".html")) return "text/html";
-	else if(path.endsWith(".htm")) return "text/html";
-	else if(path.endsWith(".css")) return "text/css";
-	else if(path.endsWith(".txt")) return "text/plain";
-	else if(path.endsWith(".js")) return "application/javascript";
-	else if(path.endsWith(".json")) return "application/json";
-	else if(path.endsWith(".png")) return "image/png";
-	else if(path.endsWith(".gif")) return "image/gif";
-	else if(path.endsWith(".jpg")) return "image/jpeg";
-	else if(path.endsWith(".ico")) return "image/x-icon";
-	else if(path.endsWith(".svg")) return "image/svg+xml";
-	else if(path.endsWith(".ttf")) return "application/x-font-ttf";
-	else if(path.endsWith(".otf")) return "application/x-font-opentype";
-	else if(path.endsWith(".woff")) return "application/font-woff";
-	else if(path.endsWith(".woff2")) return "application/font-woff2";
-	else if(path.endsWith(".eot")) return "application/vnd.ms-fontobject";
-	else if(path.endsWith(".sfnt")) return "application/font-sfnt";
-	else if(path.endsWith(".xml")) return "text/xml";
-	else if(path.endsWith(".pdf")) return "application/pdf";
-	else if(path.endsWith(".zip")) return "application/zip";
-	else if(path.endsWith(".gz")) return "application/x-gzip";
-	else if(path.endsWith(".appcache")) return "text/cache-manifest";
+	// only the extension of the last path segment is looked up
+	const char *ext = strrchr(path, '.');
+	if(ext && !strchr(ext, '/'))
+		for(const TMimeEntry *entry = mimeTable; entry->ext; entry++)
+			if(!strcasecmp(ext + 1, entry->ext))
+				return entry->type;
 
 	return "application/octet-stream";
 }
 
 
 
-
 // ------------------------
-String ESPWebDAV::urlDecode(const String& text)	{
+bool ESPWebDAV::urlDecode(char *decoded, const char *text, size_t size)	{
 // ------------------------
-	String decoded = "";
 	char temp[] = "0x00";
-	unsigned int len = text.length();
-	unsigned int i = 0;
-	while (i < len)	{
+	size_t n = 0;
+	while (*text)	{
 		char decodedChar;
-		char encodedChar = text.charAt(i++);
-		if ((encodedChar == '%') && (i + 1 < len))	{
-			temp[2] = text.charAt(i++);
-			temp[3] = text.charAt(i++);
+		char encodedChar = *text++;
+		if ((encodedChar == '%') && text[0] && text[1])	{
+			temp[2] = *text++;
+			temp[3] = *text++;
 			decodedChar = strtol(temp, NULL, 16);
 		}
 		else {
@@ -55,9 +68,13 @@ String ESPWebDAV::urlDecode(const String& text)	{
 			else
 				decodedChar = encodedChar;  // normal ascii char
 		}
-		decoded += decodedChar;
+		// does not fit the fixed buffer
+		if(n + 1 >= size)
+			return false;
+		decoded[n++] = decodedChar;
 	}
-	return decoded;
+	decoded[n] = 0;
+	return true;
 }
 
 
@@ -65,11 +82,11 @@ String ESPWebDAV::urlDecode(const String& text)	{
 
 
 // ------------------------
-String ESPWebDAV::urlToUri(String url)	{
+const char *ESPWebDAV::urlToUri(const char *url)	{
 // ------------------------
-	if(url.startsWith("http://"))	{
-		int uriStart = url.indexOf('/', 7);
-		return url.substring(uriStart);
+	if(!strncmp(url, "http://", 7))	{
+		const char *uriStart = strchr(url + 7, '/');
+		return uriStart ? uriStart : "/";
 	}
 	else
 		return url;
@@ -80,7 +97,55 @@ String ESPWebDAV::urlToUri(String url)	{
 // ------------------------
 bool ESPWebDAV::isClientWaiting() {
 // ------------------------
-	return server->hasClient();
+	bool waiting = server->hasClient();
+
+	for(uint8_t i = 0; i < DAV_MAX_CLIENTS; i++)	{
+		DAVConnection *c = &_conns[i];
+		// a request in progress needs another pass
+		if(c->_state != CONN_IDLE || c->client.available())
+			waiting = true;
+		// a persistent connection is kept until it idles out or the peer closes it
+		else if(c->client && millis() - c->_lastActivity > HTTP_KEEPALIVE_TIMEOUT)
+			closeClient(c);
+	}
+
+	return waiting;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::abortClients() {
+// ------------------------
+	// requests in progress are dropped, their files closed as on a lost connection
+	for(uint8_t i = 0; i < DAV_MAX_CLIENTS; i++)
+		if(_conns[i]._state != CONN_IDLE)
+			closeClient(&_conns[i]);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::hasClients() {
+// ------------------------
+	for(uint8_t i = 0; i < DAV_MAX_CLIENTS; i++)
+		if(_conns[i].client.connected())
+			return true;
+
+	return false;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::isBusy() {
+// ------------------------
+	// a streaming request owns an open file on the card
+	for(uint8_t i = 0; i < DAV_MAX_CLIENTS; i++)
+		if(_conns[i]._state == CONN_STREAM)
+			return true;
+
+	return false;
 }
 
 
@@ -105,117 +170,879 @@ void ESPWebDAV::rejectClient(String rejectMessage) {
 // ------------------------
 void ESPWebDAV::processClient(THandlerFunction handler, String message) {
 // ------------------------
-	// Check if a client has connected
-	client = server->available();
-	if(!client)
-		return;
+	acceptClients();
 
-	// Wait until the client sends some data
-	while(!client.available())
-		delay(1);
-	
+	// every connection makes a bounded amount of progress, none of them waits
+	for(uint8_t n = 0; n < DAV_MAX_CLIENTS; n++)	{
+		conn = &_conns[(_nextConn + n) % DAV_MAX_CLIENTS];
+		stepClient(handler, message);
+		flushOutput(false);
+	}
+
+	_nextConn = (_nextConn + 1) % DAV_MAX_CLIENTS;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::stepClient(THandlerFunction handler, String message) {
+// ------------------------
+	switch(conn->_state)	{
+		case CONN_IDLE:
+			if(!conn->client.available())
+				return;
+			beginRequest();
+			// fall through
+
+		case CONN_HEADERS:
+			if(!readRequestHead())
+				return;
+			conn->_state = CONN_BODY;
+			// fall through
+
+		case CONN_BODY:
+			// a small XML body is asked for with 100 Continue and left in the socket until
+			// it has fully arrived, over as many passes as it takes. PUT answers 100 only
+			// once the upload is set up, a rejected request not at all
+			if(conn->method != METHOD_PUT && handler == &ESPWebDAV::handleRequest)
+				sendContinue();
+			if(!conn->_expectContinue && conn->_bodyRemaining <= HTTP_KEEPALIVE_DRAIN && conn->client.available() < conn->_bodyRemaining)	{
+				if(!conn->client.connected() || millis() - conn->_lastActivity > HTTP_MAX_POST_WAIT)
+					closeClient(conn);
+				return;
+			}
+			dispatchRequest(handler, message);
+			return;
+
+		case CONN_STREAM:
+			// a rejecting pass runs without the bus, the stream resumes once it is handed back
+			if(handler != &ESPWebDAV::handleRequest)
+				return;
+			if((this->*conn->_step)())
+				finishRequest();
+			return;
+	}
+}
+
+
+
+// ------------------------
+void ESPWebDAV::acceptClients() {
+// ------------------------
+	while(server->hasClient())	{
+		DAVConnection *slot = NULL;
+
+		// take a free slot, else the longest idle persistent connection gives way
+		for(uint8_t i = 0; i < DAV_MAX_CLIENTS; i++)	{
+			DAVConnection *c = &_conns[i];
+			if(c->_state != CONN_IDLE || c->client.available())
+				continue;
+			if(!c->client)	{
+				slot = c;
+				break;
+			}
+			if(!slot || c->_lastActivity < slot->_lastActivity)
+				slot = c;
+		}
+
+		// every slot is busy, the client waits in the backlog
+		if(!slot)
+			return;
+
+		closeClient(slot);
+		slot->client = server->available();
+		slot->_requestCount = 0;
+		slot->_lastActivity = millis();
+	}
+}
+
+
+
+// ------------------------
+void ESPWebDAV::beginRequest() {
+// ------------------------
 	// reset all variables
-	_chunked = false;
-	_responseHeaders = String();
-	_contentLength = CONTENT_LENGTH_NOT_SET;
-  	_contentRangeStart = _contentRangeEnd = CONTENT_RANGE_NOT_SET;
-	method = String();
-	uri = String();
-	contentLengthHeader = String();
-  	contentRangeHeader = String();
-	depthHeader = String();
-	hostHeader = String();
-	destinationHeader = String();
+	conn->_state = CONN_HEADERS;
+	conn->_lastActivity = millis();
+	conn->_lineLen = 0;
+	conn->_headerBytes = 0;
+	conn->_chunked = false;
+	conn->_keepAlive = false;
+	conn->_http10 = false;
+	conn->_bodyRemaining = 0;
+	conn->_chunkedBody = false;
+	conn->_chunkState = CHUNK_START;
+	conn->_chunkRemaining = 0;
+	conn->_expectedLength = 0;
+	conn->_tempPath[0] = 0;
+	conn->_responseHeaders = String();
+	conn->_contentLength = CONTENT_LENGTH_NOT_SET;
+  	conn->_contentRangeStart = conn->_contentRangeEnd = CONTENT_RANGE_NOT_SET;
+	conn->_contentRangeTotal = CONTENT_RANGE_NOT_SET;
+	conn->_uploadSlot = -1;
+	conn->_rangeCount = 0;
+	conn->_haveRequestLine = false;
+	conn->method = METHOD_UNKNOWN;
+	conn->uri[0] = 0;
+	conn->destination[0] = 0;
+	conn->_ifNoneMatch[0] = 0;
+	conn->_ifModifiedSince = 0;
+	conn->_requestLength = 0;
+	conn->depth = DEPTH_NONE;
+	conn->_propDepth = 0;
+	conn->_connClose = conn->_connKeepAlive = false;
+	conn->_expectContinue = false;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::dispatchRequest(THandlerFunction handler, String message) {
+// ------------------------
+	// HTTP/1.1 keeps the connection unless asked otherwise, HTTP/1.0 only on request
+	if(conn->_http10)
+		conn->_keepAlive = conn->_connKeepAlive;
+	else
+		conn->_keepAlive = !conn->_connClose;
+	if(++conn->_requestCount >= HTTP_KEEPALIVE_MAX)
+		conn->_keepAlive = false;
 
-	// extract uri, headers etc
-	if(parseRequest())
-		// invoke the handler
-		(this->*handler)(message);
-		
-	// finalize the response
-	if(_chunked)
-		sendContent("");
+	// invoke the handler
+	(this->*handler)(message);
 
-	// send all data before closing connection
-	client.flush();
-	// close the connection
-	client.stop();
+	// a handler that streams its body finishes over the next passes
+	if(conn->_state != CONN_STREAM)
+		finishRequest();
 }
 
 
 
+// ------------------------
+void ESPWebDAV::startStream(TStepFunction step) {
+// ------------------------
+	conn->_step = step;
+	conn->_state = CONN_STREAM;
+	conn->_lastActivity = millis();
+}
+
 
 
 // ------------------------
-bool ESPWebDAV::parseRequest() {
+void ESPWebDAV::finishRequest() {
 // ------------------------
-	// Read the first line of HTTP request
-	String req = client.readStringUntil('\r');
-	client.readStringUntil('\n');
-	
-	// First line of HTTP request looks like "GET /path HTTP/1.1"
-	// Retrieve the "/path" part by finding the spaces
-	int addr_start = req.indexOf(' ');
-	int addr_end = req.indexOf(' ', addr_start + 1);
-	if (addr_start == -1 || addr_end == -1) {
+	conn->_state = CONN_IDLE;
+	releaseTransferBuffers(conn);
+
+	// finalize the response, the last chunk goes out with the terminator
+	flushOutput(true);
+
+	// send all data before deciding on the connection
+	conn->client.flush();
+
+	// a request body left unread would be parsed as the next request
+	if(conn->_keepAlive && !drainRequestBody())
+		conn->_keepAlive = false;
+
+	if(conn->_keepAlive)
+		conn->_lastActivity = millis();
+	else
+		// close the connection
+		closeClient(conn);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::sendFileSlice() {
+// ------------------------
+	if(!conn->client.connected())	{
+		closeClient(conn);
 		return false;
 	}
 
-	method = req.substring(0, addr_start);
-	uri = urlDecode(req.substring(addr_start + 1, addr_end));
-	// DBG_PRINT("method: "); DBG_PRINT(method); DBG_PRINT(" url: "); DBG_PRINTLN(uri);
-	
-	// parse and finish all headers
-	String headerName;
-	String headerValue;
-	
-	while(1) {
-		req = client.readStringUntil('\r');
-		client.readStringUntil('\n');
-		if(req == "") 
-			// no more headers
+	// response head goes out ahead of the file data
+	flushOutput(false);
+
+	// only hand TCP what it can take right now, so the pass never waits on ACKs
+	size_t budget = conn->client.availableForWrite();
+	if(budget > DAV_SEND_SLICE)
+		budget = DAV_SEND_SLICE;
+
+	// without a pooled buffer nothing may be left over for the next pass
+	uint8_t local[512] __attribute__((aligned(4)));
+
+	while(budget > 0)	{
+		uint8_t cur = conn->_sendCur;
+		if(conn->_sendBufPos == conn->_sendBufLen[cur])	{
+			conn->_sendBufLen[cur] = 0;
+			conn->_sendBufPos = 0;
+			if(conn->_sendBufLen[cur ^ 1])	{
+				// the buffer read ahead during the previous pass is next
+				conn->_sendCur = cur ^= 1;
+			}
+			else if(conn->_sendRemaining)	{
+				int numRead = conn->_xferBuf[cur] ? fillSendBuffer(conn->_xferBuf[cur], DAV_XFER_BUFFER_SIZE) : fillSendBuffer(local, (budget < sizeof(local)) ? budget : sizeof(local));
+				if(numRead <= 0)	{
+					DBG_PRINTLN("Read failed, dropping connection");
+					closeClient(conn);
+					return false;
+				}
+				conn->_sendBufLen[cur] = numRead;
+			}
+			else
+				break;
+		}
+
+		const uint8_t *buf = conn->_xferBuf[cur] ? conn->_xferBuf[cur] : local;
+		size_t numToSend = conn->_sendBufLen[cur] - conn->_sendBufPos;
+		if(numToSend > budget)
+			numToSend = budget;
+		if(numToSend > DAV_SEND_SEGMENT)
+			numToSend = DAV_SEND_SEGMENT;
+
+		// a short write leaves the rest for the next pass, only a pooled buffer keeps it that long
+		size_t numSent = conn->client.write(buf + conn->_sendBufPos, numToSend);
+		if(!numSent || (numSent < numToSend && !conn->_xferBuf[cur]))	{
+			DBG_PRINTLN("Write failed, dropping connection");
+			closeClient(conn);
+			return false;
+		}
+		conn->_sendBufPos += numSent;
+		if(numSent < numToSend)
 			break;
-			
-		int headerDiv = req.indexOf(':');
-		if (headerDiv == -1)
+		budget -= numSent;
+	}
+
+	// read ahead into the spare buffer while lwIP is still sending what was just queued,
+	// so the card and the radio work at the same time
+	uint8_t spare = conn->_sendCur ^ 1;
+	if(conn->_xferBuf[spare] && !conn->_sendBufLen[spare] && conn->_sendRemaining)	{
+		int numRead = fillSendBuffer(conn->_xferBuf[spare], DAV_XFER_BUFFER_SIZE);
+		if(numRead <= 0)	{
+			DBG_PRINTLN("Read failed, dropping connection");
+			closeClient(conn);
+			return false;
+		}
+		conn->_sendBufLen[spare] = numRead;
+	}
+
+	// the card is shared, a multi-block read never stays open past this pass
+	stopRawRead(conn);
+
+	if(conn->_sendRemaining || conn->_sendBufPos < conn->_sendBufLen[conn->_sendCur] || conn->_sendBufLen[spare])
+		return false;
+
+	// the next part of a multipart/byteranges response follows in the next pass
+	if(conn->_rangeIndex + 1 < conn->_rangeCount)	{
+		conn->_rangeIndex++;
+		startRange();
+		return false;
+	}
+	if(conn->_multipart)
+		sendContent(F("\r\n--" DAV_BYTERANGES_BOUNDARY "--\r\n"));
+
+	conn->file.close();
+	releaseTransferBuffers(conn);
+
+	unsigned long elapsed = millis() - conn->_transferStart;
+	DBG_PRINT("File sent in: "); DBG_PRINT(elapsed); DBG_PRINT(" ms, ");
+	DBG_PRINT(elapsed ? (float) conn->_sendLength / 1048.576 / elapsed : 0.0, 2); DBG_PRINTLN(" MB/s");
+	return true;
+}
+
+
+
+// ------------------------
+int ESPWebDAV::fillSendBuffer(uint8_t *buf, size_t bufSize) {
+// ------------------------
+	if(conn->_rawBlock)
+		return fillRawBuffer(buf, bufSize);
+
+	// stop at the next multiple of the buffer size in the file, so every later refill
+	// starts block aligned and FatFile::read hands it to readBlocks as one CMD18
+	size_t numToRead = bufSize - (conn->file.curPosition() % bufSize);
+	if(numToRead > conn->_sendRemaining)
+		numToRead = conn->_sendRemaining;
+
+	int numRead = conn->file.read(buf, numToRead);
+	if(numRead > 0)
+		conn->_sendRemaining -= numRead;
+	return numRead;
+}
+
+
+
+// ------------------------
+int ESPWebDAV::fillRawBuffer(uint8_t *buf, size_t bufSize) {
+// ------------------------
+	// whole blocks straight from the card, no FAT lookups and no block cache.
+	// bufSize holds whole blocks, only the last refill of a range ends inside one
+	size_t numToRead = bufSize - conn->_rawSkip;
+	if(numToRead > conn->_sendRemaining)
+		numToRead = conn->_sendRemaining;
+	size_t numBlocks = (conn->_rawSkip + numToRead + 511) / 512;
+	if(numBlocks > bufSize / 512)
+		return -1;
+
+	// one CMD18 serves every refill of this pass
+	if(!conn->_rawOpen)	{
+		if(!sd.card()->readStart(conn->_rawBlock))
+			return -1;
+		conn->_rawOpen = true;
+	}
+	for(size_t i = 0; i < numBlocks; i++)
+		if(!sd.card()->readData(buf + i * 512))	{
+			stopRawRead(conn);
+			return -1;
+		}
+	conn->_rawBlock += numBlocks;
+
+	// only a range starting inside a block leaves a gap, and only once
+	if(conn->_rawSkip)	{
+		memmove(buf, buf + conn->_rawSkip, numToRead);
+		conn->_rawSkip = 0;
+	}
+
+	conn->_sendRemaining -= numToRead;
+	return numToRead;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::stopRawRead(DAVConnection *c) {
+// ------------------------
+	if(!c->_rawOpen)
+		return;
+
+	sd.card()->readStop();
+	c->_rawOpen = false;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::claimTransferBuffers() {
+// ------------------------
+	// two buffers if the pool has them, one or none when other downloads hold the rest
+	conn->_xferBuf[0] = conn->_xferBuf[1] = NULL;
+	conn->_sendBufLen[0] = conn->_sendBufLen[1] = 0;
+	conn->_sendBufPos = 0;
+	conn->_sendCur = 0;
+	uint8_t claimed = 0;
+	for(uint8_t i = 0; i < DAV_XFER_BUFFERS && claimed < 2; i++)
+		if(!_xferBufferOwner[i])	{
+			_xferBufferOwner[i] = conn;
+			conn->_xferBuf[claimed++] = _xferBuffers[i];
+		}
+}
+
+
+
+// ------------------------
+void ESPWebDAV::releaseTransferBuffers(DAVConnection *c) {
+// ------------------------
+	for(uint8_t i = 0; i < DAV_XFER_BUFFERS; i++)
+		if(_xferBufferOwner[i] == c)
+			_xferBufferOwner[i] = NULL;
+	c->_xferBuf[0] = c->_xferBuf[1] = NULL;
+	c->_sendBufLen[0] = c->_sendBufLen[1] = 0;
+	c->_sendBufPos = 0;
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::drainRequestBody() {
+// ------------------------
+	// without 100 Continue the client may or may not send the body, only closing is safe
+	if(conn->_expectContinue && (conn->_bodyRemaining || conn->_chunkedBody))
+		return false;
+
+	// a chunked body is not worth decoding just to throw it away
+	if(conn->_chunkedBody)
+		return conn->_chunkState == CHUNK_DONE;
+
+	if(conn->_bodyRemaining > HTTP_KEEPALIVE_DRAIN)
+		return false;
+
+	// a small body has arrived before the request was dispatched, one still
+	// missing is not waited for, the connection is closed instead
+	uint8_t buf[128];
+	while(conn->_bodyRemaining > 0)
+		if(readRequestBody(buf, sizeof(buf)) == 0)
+			return false;
+	return true;
+}
+
+
+
+// ------------------------
+size_t ESPWebDAV::readChunkedBody(uint8_t *buf, size_t bufSize) {
+// ------------------------
+	// strips the chunk framing of whatever has arrived, never waits for more
+	size_t numRead = 0;
+	while(numRead < bufSize && conn->_chunkState < CHUNK_DONE)	{
+		if(conn->_chunkState == CHUNK_DATA)	{
+			size_t numToRead = bufSize - numRead;
+			if(numToRead > conn->_chunkRemaining)
+				numToRead = conn->_chunkRemaining;
+			if(numToRead > (size_t) conn->client.available())
+				numToRead = conn->client.available();
+			if(!numToRead)
+				break;
+			numToRead = conn->client.read(buf + numRead, numToRead);
+			numRead += numToRead;
+			conn->_chunkRemaining -= numToRead;
+			if(!conn->_chunkRemaining)
+				conn->_chunkState = CHUNK_DATA_END;
+			continue;
+		}
+
+		int c = conn->client.read();
+		if(c < 0)
 			break;
-		
-		headerName = req.substring(0, headerDiv);
-		headerValue = req.substring(headerDiv + 2);
-		// DBG_PRINT("\t"); DBG_PRINT(headerName); DBG_PRINT(": "); DBG_PRINTLN(headerValue);
-		
-		if(headerName.equalsIgnoreCase("Host"))
-			hostHeader = headerValue;
-		else if(headerName.equalsIgnoreCase("Depth"))
-			depthHeader = headerValue;
-		else if(headerName.equalsIgnoreCase("Content-Length"))
-			contentLengthHeader = headerValue;
-		else if(headerName.equalsIgnoreCase("Destination"))
-			destinationHeader = headerValue;
-		else if (headerName.equalsIgnoreCase("Content-Range") || headerName.equalsIgnoreCase("Range"))
-		{
-			contentRangeHeader = headerValue;
-			_contentRangeStart = _contentRangeEnd = 0;
-			bool bDashReached=false;
-			for (int i=0; i<headerValue.length(); i++)
-			{
-				if (headerValue.c_str()[i]=='-')
-				{
-  				bDashReached=true;
-				  continue;
+
+		switch(conn->_chunkState)	{
+			case CHUNK_START:
+			case CHUNK_SIZE:
+				if(isxdigit(c) && conn->_chunkRemaining < 0x08000000)	{
+					conn->_chunkRemaining = (conn->_chunkRemaining << 4) + (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+					conn->_chunkState = CHUNK_SIZE;
 				}
-				if (headerValue.c_str()[i]>='0' && headerValue.c_str()[i]<='9')
-				{
-  				if (!bDashReached)
-  					_contentRangeStart=_contentRangeStart*10+(headerValue[i]-'0');
-  				else
-  					_contentRangeEnd=_contentRangeEnd*10+(headerValue[i]-'0');
+				else if(conn->_chunkState == CHUNK_SIZE && (c == ';' || c == ' ' || c == '\t' || c == '\r'))
+					conn->_chunkState = CHUNK_EXT;
+				else if(conn->_chunkState == CHUNK_SIZE && c == '\n')
+					conn->_chunkState = conn->_chunkRemaining ? CHUNK_DATA : CHUNK_TRAILER;
+				else
+					conn->_chunkState = CHUNK_ERROR;
+				break;
+
+			case CHUNK_EXT:
+				// chunk extensions are ignored
+				if(c == '\n')
+					conn->_chunkState = conn->_chunkRemaining ? CHUNK_DATA : CHUNK_TRAILER;
+				break;
+
+			case CHUNK_DATA_END:
+				if(c == '\n')	{
+					conn->_chunkState = CHUNK_START;
+					conn->_chunkRemaining = 0;
 				}
-			}   
+				else if(c != '\r')
+					conn->_chunkState = CHUNK_ERROR;
+				break;
+
+			case CHUNK_TRAILER:
+				// trailer fields are skipped, an empty line ends the body
+				if(c == '\n')
+					conn->_chunkState = CHUNK_DONE;
+				else if(c != '\r')
+					conn->_chunkState = CHUNK_TRAILER_LINE;
+				break;
+
+			case CHUNK_TRAILER_LINE:
+				if(c == '\n')
+					conn->_chunkState = CHUNK_TRAILER;
+				break;
+
+			default:
+				break;
 		}
 	}
-	
-	return true;
+	return numRead;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::sendContinue() {
+// ------------------------
+	// interim response, it goes out ahead of anything buffered for the final one
+	if(!conn->_expectContinue)
+		return;
+	conn->_expectContinue = false;
+	conn->client.write((const uint8_t *) "HTTP/1.1 100 Continue\r\n\r\n", 25);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::bodyReceived() {
+// ------------------------
+	return conn->_chunkedBody ? (conn->_chunkState == CHUNK_DONE) : !conn->_recvRemaining;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::closeClient(DAVConnection *c) {
+// ------------------------
+	// whatever was answered still goes out, e.g. a rejected request head,
+	// the output buffer only ever holds the connection being serviced
+	if(c == conn)
+		flushOutput(false);
+
+	// abandon a request still in progress
+	closePropWalk(c);
+	if(c->_relocFile.isOpen())
+		c->_relocFile.remove();
+	// an unfinished upload leaves the target as it was, a resumable one waits for its next range
+	if(c->_uploadSlot >= 0)
+		suspendUpload(c);
+	if(c->_tempPath[0] && c->file.isOpen())
+		c->file.remove();
+	c->_tempPath[0] = 0;
+	stopRawRead(c);
+	releaseTransferBuffers(c);
+	c->_state = CONN_IDLE;
+	c->_sendRemaining = 0;
+	c->_recvRemaining = 0;
+
+	c->client.stop();
+	c->client = WiFiClient();
+}
+
+
+
+
+
+// request headers the server acts on, all others are skipped
+const ESPWebDAV::THeaderEntry ESPWebDAV::headerTable[] = {
+	{ "Depth",			&ESPWebDAV::parseDepthHeader },
+	{ "Content-Length",	&ESPWebDAV::parseLengthHeader },
+	{ "Destination",	&ESPWebDAV::parseDestinationHeader },
+	{ "Connection",		&ESPWebDAV::parseConnectionHeader },
+	{ "Content-Range",	&ESPWebDAV::parseContentRangeHeader },
+	{ "Range",			&ESPWebDAV::parseRangeHeader },
+	{ "Transfer-Encoding",	&ESPWebDAV::parseTransferEncodingHeader },
+	{ "Expect",			&ESPWebDAV::parseExpectHeader },
+	{ "X-Expected-Entity-Length",	&ESPWebDAV::parseExpectedLengthHeader },
+	{ "If-None-Match",	&ESPWebDAV::parseIfNoneMatchHeader },
+	{ "If-Modified-Since",	&ESPWebDAV::parseIfModifiedSinceHeader },
+	{ NULL,				NULL }
+};
+
+
+
+// ------------------------
+bool ESPWebDAV::readRequestHead() {
+// ------------------------
+	// consume only what has arrived, the body stays in the socket
+	int c;
+	while((c = conn->client.read()) >= 0)	{
+		conn->_lastActivity = millis();
+
+		// hard cap on the whole head, heap use does not depend on the client
+		if(++conn->_headerBytes > HTTP_MAX_HEADER_BYTES)	{
+			rejectRequestHead("431 Request Header Fields Too Large");
+			return false;
+		}
+
+		if(c == '\r')
+			continue;
+		if(c != '\n')	{
+			if(conn->_lineLen >= HTTP_MAX_LINE - 1)	{
+				rejectRequestHead(conn->_haveRequestLine ? "431 Request Header Fields Too Large" : "414 URI Too Long");
+				return false;
+			}
+			conn->_line[conn->_lineLen++] = c;
+			continue;
+		}
+		conn->_line[conn->_lineLen] = 0;
+
+		if(!conn->_haveRequestLine)	{
+			// First line of HTTP request, blank lines before it are ignored
+			if(conn->_lineLen && !parseRequestLine(conn->_line))	{
+				rejectRequestHead(conn->_haveRequestLine ? "414 URI Too Long" : "400 Bad Request");
+				return false;
+			}
+		}
+		else if(!conn->_lineLen)	{
+			// no more headers
+			// body bytes the handler is expected to consume
+			conn->_bodyRemaining = conn->_requestLength;
+			// chunked framing overrides any Content-Length
+			if(conn->_chunkedBody)
+				conn->_bodyRemaining = conn->_requestLength = 0;
+			return true;
+		}
+		else
+			parseHeaderLine(conn->_line);
+
+		conn->_lineLen = 0;
+	}
+
+	// the client stopped sending half way through the request
+	if(!conn->client.connected() || millis() - conn->_lastActivity > HTTP_MAX_POST_WAIT)
+		closeClient(conn);
+	return false;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::rejectRequestHead(const char *code) {
+// ------------------------
+	DBG_PRINT("Rejecting request head: "); DBG_PRINTLN(code);
+	conn->_keepAlive = false;
+	send(code, "text/plain", "");
+	closeClient(conn);
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::parseRequestLine(char *req) {
+// ------------------------
+	// First line of HTTP request looks like "GET /path HTTP/1.1"
+	// Retrieve the "/path" part by finding the spaces
+	char *addr_start = strchr(req, ' ');
+	char *addr_end = addr_start ? strchr(addr_start + 1, ' ') : NULL;
+	if (!addr_end) {
+		return false;
+	}
+
+	*addr_start = 0;
+	*addr_end = 0;
+	conn->_haveRequestLine = true;
+
+	// the method is resolved once here, handlers only see the enum
+	for(uint8_t m = METHOD_UNKNOWN + 1; m < METHOD_COUNT; m++)	{
+		if(!strcmp(req, methodTable[m].name))	{
+			conn->method = (MethodType) m;
+			break;
+		}
+	}
+
+	conn->_http10 = !strcmp(addr_end + 1, "HTTP/1.0");
+	// DBG_PRINT("method: "); DBG_PRINT(method); DBG_PRINT(" url: "); DBG_PRINTLN(uri);
+	return urlDecode(conn->uri, addr_start + 1, sizeof(conn->uri));
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseHeaderLine(char *req) {
+// ------------------------
+	char *headerValue = strchr(req, ':');
+	if (!headerValue)
+		return;
+
+	*headerValue++ = 0;
+	while(*headerValue == ' ' || *headerValue == '\t')
+		headerValue++;
+	// DBG_PRINT("\t"); DBG_PRINT(req); DBG_PRINT(": "); DBG_PRINTLN(headerValue);
+
+	for(const THeaderEntry *entry = headerTable; entry->name; entry++)	{
+		if(!strcasecmp(req, entry->name))	{
+			(this->*entry->parse)(headerValue);
+			return;
+		}
+	}
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseDepthHeader(char *value) {
+// ------------------------
+	if(!strcmp(value, "1"))
+		conn->depth = DEPTH_CHILD;
+	else if(!strcasecmp(value, "infinity"))
+		conn->depth = DEPTH_ALL;
+	else
+		conn->depth = DEPTH_NONE;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseLengthHeader(char *value) {
+// ------------------------
+	conn->_requestLength = strtoul(value, NULL, 10);
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseDestinationHeader(char *value) {
+// ------------------------
+	// an absolute url is reduced to its path, a destination too long is dropped
+	if(!urlDecode(conn->destination, urlToUri(value), sizeof(conn->destination)))
+		conn->destination[0] = 0;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseConnectionHeader(char *value) {
+// ------------------------
+	// comma separated tokens, only close and keep-alive matter here
+	for(char *token = strtok(value, ", "); token; token = strtok(NULL, ", "))	{
+		if(!strcasecmp(token, "close"))
+			conn->_connClose = true;
+		else if(!strcasecmp(token, "keep-alive"))
+			conn->_connKeepAlive = true;
+	}
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseRangeHeader(char *value) {
+// ------------------------
+	// "bytes=first-last, first-, -suffix", RFC 7233 says to ignore a header that does not parse
+	conn->_rangeCount = 0;
+	if(strncasecmp(value, "bytes=", 6))
+		return;
+
+	for(char *spec = strtok(value + 6, ","); spec; spec = strtok(NULL, ","))	{
+		while(*spec == ' ' || *spec == '\t')
+			spec++;
+		// too many ranges, the whole file is cheaper for both sides
+		if(conn->_rangeCount == DAV_MAX_RANGES)	{
+			conn->_rangeCount = 0;
+			return;
+		}
+
+		DAVRange &r = conn->_ranges[conn->_rangeCount];
+		char *end = spec;
+		if(*spec == '-')	{
+			if(!isdigit(spec[1]))
+				goto invalid;
+			r.first = DAV_RANGE_OPEN;
+			r.last = strtoul(spec + 1, &end, 10);
+		}
+		else	{
+			if(!isdigit(*spec))
+				goto invalid;
+			r.first = strtoul(spec, &end, 10);
+			if(*end++ != '-')
+				goto invalid;
+			if(isdigit(*end))	{
+				r.last = strtoul(end, &end, 10);
+				if(r.last < r.first)
+					goto invalid;
+			}
+			else
+				r.last = DAV_RANGE_OPEN;
+		}
+
+		while(*end == ' ' || *end == '\t')
+			end++;
+		if(*end)
+			goto invalid;
+		conn->_rangeCount++;
+	}
+	return;
+
+invalid:
+	conn->_rangeCount = 0;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseContentRangeHeader(char *value) {
+// ------------------------
+	// "bytes first-last/length" of a PUT, a known length makes the upload resumable
+	conn->_contentRangeStart = conn->_contentRangeEnd = 0;
+	bool bDashReached=false;
+	for (; *value && *value != '/'; value++)
+	{
+		if (*value=='-')
+		{
+			bDashReached=true;
+		  continue;
+		}
+		if (*value>='0' && *value<='9')
+		{
+			if (!bDashReached)
+				conn->_contentRangeStart=conn->_contentRangeStart*10+(*value-'0');
+			else
+				conn->_contentRangeEnd=conn->_contentRangeEnd*10+(*value-'0');
+		}
+	}
+	if(*value == '/' && isdigit(value[1]))
+		conn->_contentRangeTotal = strtoul(value + 1, NULL, 10);
+}
+
+
+
+
+// ------------------------
+void ESPWebDAV::parseTransferEncodingHeader(char *value) {
+// ------------------------
+	// chunked is always the last coding, others are not accepted for request bodies
+	for(char *token = strtok(value, ", "); token; token = strtok(NULL, ", "))
+		conn->_chunkedBody = !strcasecmp(token, "chunked");
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseExpectHeader(char *value) {
+// ------------------------
+	// HTTP/1.0 clients do not know the interim response and must not get one
+	if(!conn->_http10 && !strcasecmp(value, "100-continue"))
+		conn->_expectContinue = true;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseExpectedLengthHeader(char *value) {
+// ------------------------
+	// sent by davfs2 and the macOS Finder along with a chunked body
+	conn->_expectedLength = strtoul(value, NULL, 10);
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseIfNoneMatchHeader(char *value) {
+// ------------------------
+	// a list too long keeps its leading tags, a tag cut short can never match
+	strncpy(conn->_ifNoneMatch, value, sizeof(conn->_ifNoneMatch) - 1);
+	conn->_ifNoneMatch[sizeof(conn->_ifNoneMatch) - 1] = 0;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::parseIfModifiedSinceHeader(char *value) {
+// ------------------------
+	// "Tue, 13 Oct 2015 17:07:35 GMT", packed the way FAT stamps compare
+	char mon[4];
+	int day, year, hour, minute, second;
+	conn->_ifModifiedSince = 0;
+	if(sscanf(value, "%*[^,], %d %3s %d %d:%d:%d", &day, mon, &year, &hour, &minute, &second) != 6)
+		return;
+	// dates outside the FAT range are treated as absent
+	if(year < 1980 || year > 2107)
+		return;
+
+	for(uint8_t m = 0; m < 12; m++)
+		if(!strcmp(mon, months[m]))	{
+			conn->_ifModifiedSince = ((uint32_t) FAT_DATE(year, m + 1, day) << 16) | FAT_TIME(hour, minute, second);
+			return;
+		}
+}
+
+
+
+// ------------------------
+bool ESPWebDAV::isNotModified(const dir_t *dir, const char *etag) {
+// ------------------------
+	// If-None-Match takes precedence over If-Modified-Since
+	if(conn->_ifNoneMatch[0])
+		return !strcmp(conn->_ifNoneMatch, "*") || strstr(conn->_ifNoneMatch, etag);
+
+	if(conn->_ifModifiedSince)
+		return (((uint32_t) dir->lastWriteDate << 16) | dir->lastWriteTime) <= conn->_ifModifiedSince;
+
+	return false;
 }
 
 
@@ -227,9 +1054,9 @@ void ESPWebDAV::sendHeader(const String& name, const String& value, bool first)
 	String headerLine = name + ": " + value + "\r\n";
 
 	if (first)
-		_responseHeaders = headerLine + _responseHeaders;
+		conn->_responseHeaders = headerLine + conn->_responseHeaders;
 	else
-		_responseHeaders += headerLine;
+		conn->_responseHeaders += headerLine;
 }
 
 
@@ -240,7 +1067,7 @@ void ESPWebDAV::send(String code, const char* content_type, const String& conten
 	String header;
 	_prepareHeader(header, code, content_type, content.length());
 
-	client.write(header.c_str(), header.length());
+	bufferOutput(header.c_str(), header.length(), false, true);
 	if(content.length())
 		sendContent(content);
 }
@@ -255,18 +1082,23 @@ void ESPWebDAV::_prepareHeader(String& response, String code, const char* conten
 	if(content_type)
 		sendHeader("Content-Type", content_type, true);
 	
-	if(_contentLength == CONTENT_LENGTH_NOT_SET)
+	if(conn->_contentLength == CONTENT_LENGTH_NOT_SET)
 		sendHeader("Content-Length", String(contentLength));
-	else if(_contentLength != CONTENT_LENGTH_UNKNOWN)
-		sendHeader("Content-Length", String(_contentLength));
-	else if(_contentLength == CONTENT_LENGTH_UNKNOWN) {
-		_chunked = true;
+	else if(conn->_contentLength != CONTENT_LENGTH_UNKNOWN)
+		sendHeader("Content-Length", String(conn->_contentLength));
+	else if(conn->_contentLength == CONTENT_LENGTH_UNKNOWN) {
+		conn->_chunked = true;
 		sendHeader("Accept-Ranges","bytes");
 		sendHeader("Transfer-Encoding","chunked");
 	}
-	sendHeader("Connection", "close");
+	if(conn->_keepAlive)	{
+		sendHeader("Connection", "keep-alive");
+		sendHeader("Keep-Alive", "timeout=" + String(HTTP_KEEPALIVE_TIMEOUT / 1000) + ", max=" + String(HTTP_KEEPALIVE_MAX - conn->_requestCount));
+	}
+	else
+		sendHeader("Connection", "close");
 
-	response += _responseHeaders;
+	response += conn->_responseHeaders;
 	response += "\r\n";
 }
 
@@ -275,90 +1107,119 @@ void ESPWebDAV::_prepareHeader(String& response, String code, const char* conten
 // ------------------------
 void ESPWebDAV::sendContent(const String& content) {
 // ------------------------
-	const char * footer = "\r\n";
-	size_t size = content.length();
-	
-	if(_chunked) {
-		char * chunkSize = (char *) malloc(11);
-		if(chunkSize) {
-			sprintf(chunkSize, "%x%s", size, footer);
-			client.write(chunkSize, strlen(chunkSize));
-			free(chunkSize);
-		}
-	}
-	
-	client.write(content.c_str(), size);
-	
-	if(_chunked) {
-		client.write(footer, 2);
-		if (size == 0) {
-			_chunked = false;
-		}
+	// an empty chunk ends a chunked response
+	if(!content.length())	{
+		if(conn->_chunked)
+			flushOutput(true);
+		return;
 	}
+
+	bufferOutput(content.c_str(), content.length(), false, false);
 }
 
 
 
 // ------------------------
-void ESPWebDAV::sendContent_P(PGM_P content) {
+void ESPWebDAV::sendContent(const __FlashStringHelper *content) {
 // ------------------------
-	const char * footer = "\r\n";
-	size_t size = strlen_P(content);
-	
-	if(_chunked) {
-		char * chunkSize = (char *) malloc(11);
-		if(chunkSize) {
-			sprintf(chunkSize, "%x%s", size, footer);
-			client.write(chunkSize, strlen(chunkSize));
-			free(chunkSize);
-		}
-	}
-	
-	client.write_P(content, size);
-	
-	if(_chunked) {
-		client.write(footer, 2);
-		if (size == 0) {
-			_chunked = false;
-		}
-	}
+	sendContent_P((PGM_P) content);
 }
 
 
 
 // ------------------------
-void ESPWebDAV::setContentLength(size_t len)	{
+void ESPWebDAV::sendContent(const char *content) {
 // ------------------------
-	_contentLength = len;
+	bufferOutput(content, strlen(content), false, false);
 }
 
 
+
 // ------------------------
-size_t ESPWebDAV::readBytesWithTimeout(uint8_t *buf, size_t bufSize) {
+void ESPWebDAV::sendContent_P(PGM_P content) {
 // ------------------------
-	int timeout_ms = HTTP_MAX_POST_WAIT;
-	size_t numAvailable = 0;
-	while(!(numAvailable = client.available()) && client.connected() && timeout_ms--) 
-		delay(1);
+	// copied straight from flash into the output buffer
+	bufferOutput(content, strlen_P(content), true, false);
+}
 
-	if(!numAvailable)
-		return 0;
 
-	return client.read(buf, bufSize);
+
+// ------------------------
+void ESPWebDAV::bufferOutput(const char *data, size_t len, bool progmem, bool raw) {
+// ------------------------
+	while(len > 0)	{
+		size_t room = DAV_OUT_BUFFER - DAV_OUT_RESERVE - _outLen;
+		if(room == 0)	{
+			flushOutput(false);
+			continue;
+		}
+
+		size_t n = (len > room) ? room : len;
+		if(progmem)
+			memcpy_P(_outBuf + _outLen, data, n);
+		else
+			memcpy(_outBuf + _outLen, data, n);
+		_outLen += n;
+		data += n;
+		len -= n;
+
+		if(raw)
+			_outRaw = _outLen;
+	}
 }
 
 
+
 // ------------------------
-size_t ESPWebDAV::readBytesWithTimeout(uint8_t *buf, size_t bufSize, size_t numToRead) {
+void ESPWebDAV::flushOutput(bool last) {
 // ------------------------
-	int timeout_ms = HTTP_MAX_POST_WAIT;
-	size_t numAvailable = 0;
-	
-	while(((numAvailable = client.available()) < numToRead) && client.connected() && timeout_ms--) 
-		delay(1);
+	// frame everything after the response head as one chunk, written in a single call
+	if(conn->_chunked)	{
+		size_t body = _outLen - _outRaw;
+		if(body > 0)	{
+			char head[8];
+			size_t headLen = sprintf(head, "%x\r\n", body);
+			memmove(_outBuf + _outRaw + headLen, _outBuf + _outRaw, body);
+			memcpy(_outBuf + _outRaw, head, headLen);
+			_outLen += headLen;
+			memcpy(_outBuf + _outLen, "\r\n", 2);
+			_outLen += 2;
+		}
+		if(last)	{
+			memcpy(_outBuf + _outLen, "0\r\n\r\n", 5);
+			_outLen += 5;
+			conn->_chunked = false;
+		}
+	}
 
-	if(!numAvailable)
+	if(_outLen > 0)
+		conn->client.write((const uint8_t *) _outBuf, _outLen);
+	_outLen = 0;
+	_outRaw = 0;
+}
+
+
+
+// ------------------------
+void ESPWebDAV::setContentLength(size_t len)	{
+// ------------------------
+	conn->_contentLength = len;
+}
+
+
+// ------------------------
+size_t ESPWebDAV::readRequestBody(uint8_t *buf, size_t bufSize) {
+// ------------------------
+	// whatever of the body has arrived, never waits and never reads into a pipelined request
+	if(bufSize > conn->_bodyRemaining)
+		bufSize = conn->_bodyRemaining;
+	size_t numAvailable = conn->client.available();
+	if(bufSize > numAvailable)
+		bufSize = numAvailable;
+	if(!bufSize)
 		return 0;
 
-	return client.read(buf, bufSize);
+	size_t numRead = conn->client.read(buf, bufSize);
+	conn->_bodyRemaining -= numRead;
+	return numRead;
 }
@@ -93,7 +93,7 @@ bool Network::isConnecting() {
 
 // a client is waiting and FS is ready and other SPI master is not using the bus
 bool Network::ready() {
-  if(!isConnected()) return false;
+  if(!isConnected() || WiFi.status() != WL_CONNECTED) return false;
   
   // do it only if there is a need to read FS
 	if(!dav.isClientWaiting())	return false;
@@ -116,6 +116,19 @@ void Network::handle() {
   if(network.ready()) {
 	  sdcontrol.takeBusControl();
 	  dav.handleClient();
+	  // every pass hands the bus back, a stream takes its next slice once Marlin leaves it free
+	  sdcontrol.relinquishBusControl();
+	}
+	// a stream that can no longer be served, e.g. WiFi dropped, is closed while the bus is free
+	else if(dav.isBusy() && (!isConnected() || WiFi.status() != WL_CONNECTED) && sdcontrol.canWeTakeBus()) {
+	  sdcontrol.takeBusControl();
+	  dav.abortClients();
+	  sdcontrol.relinquishBusControl();
+	}
+	// confirm the free space PROPFIND reports, or store a changed count, while no client is connected and the bus is free
+	else if(isConnected() && !initFailed && dav.wantsFreeCount() && sdcontrol.canWeTakeBus()) {
+	  sdcontrol.takeBusControl();
+	  dav.countFreeSpace();
 	  sdcontrol.relinquishBusControl();
 	}
 }
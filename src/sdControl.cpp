@@ -1,17 +1,21 @@
 #include <ESP8266WiFi.h>
 #include "sdControl.h"
 #include "pins.h"
+#include "ESPWebDAV.h"
 
 volatile long SDControl::_spiBlockoutTime = 0;
 bool SDControl::_weTookBus = false;
+volatile bool SDControl::_otherMasterUsedBus = false;
 
 void SDControl::setup() {
   // ----- GPIO -------
 	// Detect when other master uses SPI bus
 	pinMode(CS_SENSE, INPUT);
 	attachInterrupt(CS_SENSE, []() {
-		if(!_weTookBus)
+		if(!_weTookBus)	{
 			_spiBlockoutTime = millis() + SPI_BLOCKOUT_PERIOD;
+			_otherMasterUsedBus = true;
+		}
 	}, FALLING);
 
 	// wait for other master to assert SPI bus first
@@ -22,6 +26,12 @@ void SDControl::setup() {
 void SDControl::takeBusControl()	{
 // ------------------------
 	_weTookBus = true;
+	// the card may have been written meanwhile, cached blocks and listings can't be trusted
+	if(_otherMasterUsedBus)	{
+		_otherMasterUsedBus = false;
+		dav.invalidateBlockCache();
+		dav.invalidateListCache();
+	}
 	//LED_ON;
 	pinMode(MISO_PIN, SPECIAL);	
 	pinMode(MOSI_PIN, SPECIAL);	
@@ -32,6 +42,9 @@ void SDControl::takeBusControl()	{
 // ------------------------
 void SDControl::relinquishBusControl()	{
 // ------------------------
+	// Marlin reads the FAT straight from the card, nothing may be left in the cache
+	dav.flushBlockCache();
+
 	pinMode(MISO_PIN, INPUT);	
 	pinMode(MOSI_PIN, INPUT);	
 	pinMode(SCLK_PIN, INPUT);	
@@ -14,6 +14,7 @@ public:
 private:
   static volatile long _spiBlockoutTime;
   static bool _weTookBus;
+  static volatile bool _otherMasterUsedBus;
 };
 
 extern SDControl sdcontrol;